@@ -1,6 +1,56 @@
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
 
 namespace myCompiler {
-	
+
+//Interned identifier, see StringInterner
+typedef uint32_t SymbolId;
+
+//Index of a node in its module's ASTContext. Children refer to each other by index instead of by
+//pointer; a default constructed id means "no node" and tests false.
+struct ExprId {
+	uint32_t index;
+
+	ExprId() : index(0xFFFFFFFFu) {}
+	explicit ExprId(uint32_t _index) : index(_index) {}
+
+	explicit operator bool() const { return index != 0xFFFFFFFFu; }
+	bool operator==(ExprId other) const { return index == other.index; }
+	bool operator!=(ExprId other) const { return index != other.index; }
+};
+
+//Contiguous run of entries in one of the ASTContext side tables (call arguments, prototype
+//arguments, var bindings)
+struct ListRange {
+	uint32_t first = 0;
+	uint32_t count = 0;
+
+	uint32_t size() const { return count; }
+};
+
+template <typename T>
+struct ListRef {
+	const T* data;
+	uint32_t count;
+
+	const T* begin() const { return data; }
+	const T* end() const { return data + count; }
+	uint32_t size() const { return count; }
+	const T& operator[](uint32_t i) const { return data[i]; }
+};
+
+struct VarBinding {
+	SymbolId Name;
+	//initializer, may be empty
+	ExprId Init;
+};
+
 enum ExprType {
 	exprTypeInvalid = -1,
 	exprTypeNumber,
@@ -11,173 +61,402 @@ enum ExprType {
 	exprTypeFunc,
 	exprTypePrototype,
 	exprTypeCall,
-	exprTypeVarExpr
+	exprTypeVarExpr,
+	exprTypeUnary
 };
-	
+
+//Nodes live in an ASTContext arena and are released in bulk without running destructors, so every
+//node must only hold trivially destructible members (ids, ranges, scalars).
+//The node kind is stored in the node itself; passes switch on it and static_cast (see ASTVisitor.h),
+//so nodes carry no vtable and nothing needs RTTI.
 class ExprAST {
 public:
-    virtual ~ExprAST() {}
-	virtual ExprType getType() {}
+	ExprType Type;
+	//has no side effects and may be shared by identical subtrees (see HashCons.h)
+	bool Pure;
 
+	ExprAST(ExprType _type) : Type(_type), Pure(false) {}
+	ExprType getType() const { return Type; }
 };
 
 
 class NumberExprAST : public ExprAST {
 	public:
-	
+	static const ExprType classType = exprTypeNumber;
+
     double Val;
-	
-    NumberExprAST (double _val) : Val(_val) {}
+
+    NumberExprAST (double _val) : ExprAST(classType), Val(_val) {}
     double getVal() {return Val;}
-	ExprType getType() override {return exprTypeNumber;};
 	//Value* codegen();
 };
 
 
 class VariableExprAST : public ExprAST {
 	public:
-	
-    std::string Name;
+	static const ExprType classType = exprTypeVariable;
+
+    SymbolId Name;
 
-    VariableExprAST (std::string &_Name) : Name (_Name) {}
-	std::string getName() {return Name;}
-	ExprType getType() override {return exprTypeVariable;};
+    VariableExprAST (SymbolId _Name) : ExprAST(classType), Name (_Name) {}
+	SymbolId getName() {return Name;}
 	//Value* codegen();
 };
 
 class BinaryExprAST : public ExprAST {
 	public:
-	
-    char op;
-    std::shared_ptr<ExprAST> LHS, RHS;
-
-
-    BinaryExprAST (char _op, std::shared_ptr<ExprAST> _lhs, std::shared_ptr<ExprAST> _rhs) : op(_op), LHS(std::move(_lhs)), RHS(std::move(_rhs)) {}
-    BinaryExprAST (BinaryExprAST&& other) {
-        this->op = other.op;
-        this->LHS = std::move(other.LHS);
-        this->RHS = std::move(other.RHS);
-
-        other.LHS = nullptr;
-        other.RHS = nullptr;
-    }
-    BinaryExprAST& operator=(BinaryExprAST&& other) {
-        this->op = other.op;
-        this->LHS = std::move(other.LHS);
-        this->RHS = std::move(other.RHS);
-
-        other.LHS = nullptr;
-        other.RHS = nullptr;
-
-        return *this;
-    }
-	
-	ExprType getType() override {return exprTypeBinaryExpr;};
-	
+	static const ExprType classType = exprTypeBinaryExpr;
+
+    //OperatorId, see Operators.h
+    uint8_t op;
+    ExprId LHS, RHS;
+
+
+    BinaryExprAST (uint8_t _op, ExprId _lhs, ExprId _rhs) : ExprAST(classType), op(_op), LHS(_lhs), RHS(_rhs) {}
+
+
 	//Value* codegen();
-	
+
+};
+
+//Prefix use of an operator declared with 'def unary'
+class UnaryExprAST : public ExprAST {
+	public:
+	static const ExprType classType = exprTypeUnary;
+
+	//OperatorId, see Operators.h
+	uint8_t op;
+	ExprId Operand;
+
+
+	UnaryExprAST (uint8_t _op, ExprId _operand) : ExprAST(classType), op(_op), Operand(_operand) {}
 };
 
 class CallExprAST : public ExprAST {
 	public:
-	
-    std::string Callee;
-    std::vector<std::shared_ptr<ExprAST>> Args;
-
-
-    CallExprAST (std::string &_callee, std::vector<std::shared_ptr<ExprAST>> _args) : Callee(_callee), Args(std::move(_args)) {}
-    CallExprAST (CallExprAST&& other) {
-        this->Callee = other.Callee;
-        this->Args = std::move(other.Args);
-    }
-
-    CallExprAST& operator=(CallExprAST&& other)
-    {
-        this->Callee = other.Callee;
-        this->Args = std::move(other.Args);
-        return *this;
-    }
-	
-	ExprType getType() override {return exprTypeCall;};
+	static const ExprType classType = exprTypeCall;
+
+    SymbolId Callee;
+    //range in ASTContext::exprLists
+    ListRange Args;
+
+
+    CallExprAST (SymbolId _callee, ListRange _args) : ExprAST(classType), Callee(_callee), Args(_args) {}
+
 	//Value* codegen();
 };
 
+//'def fast f(x)' gives f every fast-math flag and fast contraction, 'def strict f(x)' none of them;
+//other functions follow the command line
+enum FloatMode : uint8_t { floatDefault, floatFast, floatStrict };
+
 class PrototypeAST : public ExprAST {
 	public:
-	
-    std::string Name;
-    std::vector<std::string> Args;
+	static const ExprType classType = exprTypePrototype;
 
+    SymbolId Name;
+    //range in ASTContext::symbolLists
+    ListRange Args;
+	//top-level expressions are wrapped in a prototype without a name
+	bool Anonymous;
+	//made by the compiler (e.g. a specialization); given internal linkage
+	bool Internal = false;
+	FloatMode Float = floatDefault;
 
-    PrototypeAST (std::string _name, std::vector<std::string> _args) : Name(_name), Args(std::move (_args)) {}
-    /*PrototypeAST (PrototypeAST&& other){
-        this->Name = other.Name;
-        this->Args = other.Args;
-    }*/
 
-    const std::string &getName() const { return Name; }
-	
-	ExprType getType() override {return exprTypePrototype;};
+    PrototypeAST (SymbolId _name, ListRange _args, bool _anonymous = false) : ExprAST(classType), Name(_name), Args(_args), Anonymous(_anonymous) {}
+
+    SymbolId getName() const { return Name; }
+
 	//Value* codegen();
 
 };
 
 class FunctionAST : public ExprAST {
 	public:
-	
-    std::shared_ptr<PrototypeAST> Proto;
-    std::shared_ptr<ExprAST> Body;
-
-
-    FunctionAST (FunctionAST&& other) {
-        this->Proto = std::move(other.Proto);
-        this->Body = std::move(other.Body);
-    }
-	
-	FunctionAST (std::shared_ptr<PrototypeAST> _proto, std::shared_ptr<ExprAST> _body) : Proto(std::move(_proto)), Body(std::move(_body)) {}
-	
-	ExprType getType() override {return exprTypeFunc;};
+	static const ExprType classType = exprTypeFunc;
+
+    ExprId Proto;
+    ExprId Body;
+
+
+	FunctionAST (ExprId _proto, ExprId _body) : ExprAST(classType), Proto(_proto), Body(_body) {}
+
 	//Value* codegen();
 };
 
 class IfExprAST : public ExprAST {
 	public:
-	
-	std::shared_ptr<ExprAST> Cond, Then, Else;
-	
-	
-	IfExprAST(std::shared_ptr<ExprAST> _Cond, std::shared_ptr<ExprAST> _Then, std::shared_ptr<ExprAST> _Else)
-	 : Cond(std::move(_Cond)),Then(std::move(_Then)),Else(std::move(_Else)) {}
-	
-	ExprType getType() override {return exprTypeIf;};
+	static const ExprType classType = exprTypeIf;
+
+	ExprId Cond, Then, Else;
+
+
+	IfExprAST(ExprId _Cond, ExprId _Then, ExprId _Else)
+	 : ExprAST(classType), Cond(_Cond),Then(_Then),Else(_Else) {}
+
 	//Value* codegen();
 };
 
 class ForExprAST : public ExprAST {
 	public:
-	
-	std::string InductionVarName;
-	std::shared_ptr<ExprAST> Start, End, Step, Body;
-	
-	
-	ForExprAST (std::string _varName, std::shared_ptr<ExprAST> start, std::shared_ptr<ExprAST> end, std::shared_ptr<ExprAST> step, std::shared_ptr<ExprAST> body):
-	InductionVarName(_varName), Start(std::move(start)), End(std::move(end)), Step(std::move(step)), Body(std::move(body)) {}
-	
-	ExprType getType() override {return exprTypeFor;};
+	static const ExprType classType = exprTypeFor;
+
+	SymbolId InductionVarName;
+	ExprId Start, End, Step, Body;
+
+
+	ForExprAST (SymbolId _varName, ExprId start, ExprId end, ExprId step, ExprId body):
+	ExprAST(classType), InductionVarName(_varName), Start(start), End(end), Step(step), Body(body) {}
+
 	//Value* codegen();
 };
 
 class VarExprAST : public ExprAST {
 	public:
-	std::vector<std::pair<std::string, std::shared_ptr<ExprAST>>> VarNames;
-	std::shared_ptr<ExprAST> Body;
-	
-	
-	VarExprAST (std::vector<std::pair<std::string, std::shared_ptr<ExprAST>>> _varNames, std::shared_ptr<ExprAST> _body) : Body(std::move(_body)), VarNames(std::move(_varNames)) {}
-	
-	ExprType getType() override {return exprTypeVarExpr;};
+	static const ExprType classType = exprTypeVarExpr;
+	//range in ASTContext::varBindings
+	ListRange VarNames;
+	ExprId Body;
+
+
+	VarExprAST (ListRange _varNames, ExprId _body) : ExprAST(classType), VarNames(_varNames), Body(_body) {}
+
 	//Value* codegen();
-	
+
+};
+
+//Owns every node of one module. Nodes are bump allocated back to back in large chunks, looked up by
+//ExprId through 'nodes', and all freed together when the context is cleared or destroyed.
+class ASTContext {
+
+	private:
+
+	static const size_t ChunkSize = 1 << 20;
+
+	std::vector<std::unique_ptr<char[]>> chunks;
+	size_t chunkUsed = ChunkSize;
+	size_t bytesAllocated = 0;
+
+	std::vector<ExprAST*> nodes;
+	std::vector<ExprId> exprLists;
+	std::vector<SymbolId> symbolLists;
+	std::vector<VarBinding> varBindings;
+
+	void* allocate(size_t size, size_t align)
+	{
+		chunkUsed = (chunkUsed + align - 1) & ~(align - 1);
+		if (chunkUsed + size > ChunkSize) {
+			chunks.emplace_back(new char[ChunkSize]);
+			chunkUsed = 0;
+		}
+		void* mem = chunks.back().get() + chunkUsed;
+		chunkUsed += size;
+		bytesAllocated += size;
+		return mem;
+	}
+
+	template <typename T>
+	static ListRange append(std::vector<T> &table, const T* items, size_t count)
+	{
+		ListRange range;
+		range.first = table.size();
+		range.count = count;
+		table.insert(table.end(), items, items + count);
+		return range;
+	}
+
+	public:
+
+	ASTContext() {}
+	ASTContext(const ASTContext&) = delete;
+	ASTContext& operator=(const ASTContext&) = delete;
+
+	template <typename T, typename ...Args>
+	ExprId create(Args&& ...args)
+	{
+		static_assert(sizeof(T) <= ChunkSize, "AST node larger than an arena chunk");
+		void* mem = allocate(sizeof(T), alignof(T));
+		nodes.push_back(new (mem) T(std::forward<Args>(args)...));
+		return ExprId(nodes.size() - 1);
+	}
+
+	ExprAST* get(ExprId id) const { return nodes[id.index]; }
+
+	//Node id as its concrete type; the caller knows the kind
+	template <typename T>
+	T* as(ExprId id) const
+	{
+		assert(nodes[id.index]->getType() == T::classType);
+		return static_cast<T*>(nodes[id.index]);
+	}
+
+	//Node id as its concrete type, or nullptr if it is some other kind
+	template <typename T>
+	T* asOrNull(ExprId id) const
+	{
+		ExprAST* node = nodes[id.index];
+		return node->getType() == T::classType ? static_cast<T*>(node) : nullptr;
+	}
+
+	ListRange addExprList(const ExprId* items, size_t count) { return append(exprLists, items, count); }
+	ListRange addSymbolList(const std::vector<SymbolId> &items) { return append(symbolLists, items.data(), items.size()); }
+	ListRange addVarBindings(const VarBinding* items, size_t count) { return append(varBindings, items, count); }
+
+	ListRef<ExprId> exprList(ListRange range) const { return {exprLists.data() + range.first, range.count}; }
+	ListRef<SymbolId> symbolList(ListRange range) const { return {symbolLists.data() + range.first, range.count}; }
+	ListRef<VarBinding> varBindingList(ListRange range) const { return {varBindings.data() + range.first, range.count}; }
+
+	size_t size() const { return nodes.size(); }
+
+	//Calls f on a reference to each child id of 'node', in the order codegen evaluates them, so f
+	//can also replace children. Prototypes and a var's missing initializers are not visited.
+	template <typename F>
+	void forEachChild(ExprAST* node, F f)
+	{
+		switch (node->getType()) {
+			case exprTypeBinaryExpr: {
+				BinaryExprAST* e = static_cast<BinaryExprAST*>(node);
+				f(e->LHS);
+				f(e->RHS);
+				break;
+			}
+			case exprTypeUnary:
+				f(static_cast<UnaryExprAST*>(node)->Operand);
+				break;
+			case exprTypeCall: {
+				ListRange args = static_cast<CallExprAST*>(node)->Args;
+				for (uint32_t i = 0; i < args.count; i++)
+					f(exprLists[args.first + i]);
+				break;
+			}
+			case exprTypeFunc:
+				f(static_cast<FunctionAST*>(node)->Body);
+				break;
+			case exprTypeIf: {
+				IfExprAST* e = static_cast<IfExprAST*>(node);
+				f(e->Cond);
+				f(e->Then);
+				f(e->Else);
+				break;
+			}
+			case exprTypeFor: {
+				ForExprAST* e = static_cast<ForExprAST*>(node);
+				//the guard tests End before the first iteration; the latch tests it again after Step
+				f(e->Start);
+				f(e->End);
+				f(e->Body);
+				f(e->Step);
+				break;
+			}
+			case exprTypeVarExpr: {
+				VarExprAST* e = static_cast<VarExprAST*>(node);
+				for (uint32_t i = 0; i < e->VarNames.count; i++)
+					if (varBindings[e->VarNames.first + i].Init)
+						f(varBindings[e->VarNames.first + i].Init);
+				f(e->Body);
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	//node bytes handed out so far, for statistics
+	size_t bytesUsed() const { return bytesAllocated; }
+
+	//Moves every node of 'other' into this context, leaving 'other' empty. Ids inside the moved nodes
+	//are rebased; returns the offset to add to ids that referred into 'other'.
+	uint32_t absorb(ASTContext &other)
+	{
+		uint32_t nodeBase = nodes.size();
+		uint32_t exprListBase = exprLists.size();
+		uint32_t symbolListBase = symbolLists.size();
+		uint32_t varBindingBase = varBindings.size();
+		auto rebase = [nodeBase](ExprId &id) {
+			if (id)
+				id.index += nodeBase;
+		};
+
+		for (ExprId id : other.exprLists) {
+			rebase(id);
+			exprLists.push_back(id);
+		}
+		symbolLists.insert(symbolLists.end(), other.symbolLists.begin(), other.symbolLists.end());
+		for (VarBinding binding : other.varBindings) {
+			rebase(binding.Init);
+			varBindings.push_back(binding);
+		}
+
+		for (ExprAST* node : other.nodes) {
+			switch (node->getType()) {
+				case exprTypeBinaryExpr: {
+					BinaryExprAST* e = static_cast<BinaryExprAST*>(node);
+					rebase(e->LHS);
+					rebase(e->RHS);
+					break;
+				}
+				case exprTypeUnary:
+					rebase(static_cast<UnaryExprAST*>(node)->Operand);
+					break;
+				case exprTypeCall:
+					static_cast<CallExprAST*>(node)->Args.first += exprListBase;
+					break;
+				case exprTypePrototype:
+					static_cast<PrototypeAST*>(node)->Args.first += symbolListBase;
+					break;
+				case exprTypeFunc: {
+					FunctionAST* e = static_cast<FunctionAST*>(node);
+					rebase(e->Proto);
+					rebase(e->Body);
+					break;
+				}
+				case exprTypeIf: {
+					IfExprAST* e = static_cast<IfExprAST*>(node);
+					rebase(e->Cond);
+					rebase(e->Then);
+					rebase(e->Else);
+					break;
+				}
+				case exprTypeFor: {
+					ForExprAST* e = static_cast<ForExprAST*>(node);
+					rebase(e->Start);
+					rebase(e->End);
+					rebase(e->Step);
+					rebase(e->Body);
+					break;
+				}
+				case exprTypeVarExpr: {
+					VarExprAST* e = static_cast<VarExprAST*>(node);
+					e->VarNames.first += varBindingBase;
+					rebase(e->Body);
+					break;
+				}
+				default:
+					break;
+			}
+			nodes.push_back(node);
+		}
+
+		//the other chunks go in front so allocation carries on in this context's current chunk
+		chunks.insert(chunks.begin(), std::make_move_iterator(other.chunks.begin()), std::make_move_iterator(other.chunks.end()));
+		bytesAllocated += other.bytesAllocated;
+		other.chunks.clear();
+		other.clear();
+		return nodeBase;
+	}
+
+	//Drops every node at once
+	void clear()
+	{
+		chunks.clear();
+		chunkUsed = ChunkSize;
+		bytesAllocated = 0;
+		nodes.clear();
+		exprLists.clear();
+		symbolLists.clear();
+		varBindings.clear();
+	}
 };
 
 }
@@ -0,0 +1,67 @@
+#ifndef ASTVISITOR_DEFINED
+#define ASTVISITOR_DEFINED
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+namespace myCompiler {
+
+//Base for every pass over the AST (codegen, folding, analysis, evaluation).
+//
+//A pass derives from ASTVisitor<Pass, Result> and provides one visit() overload per node class:
+//
+//  class Printer : public ASTVisitor<Printer, void> {
+//      void visit(NumberExprAST* e);
+//      void visit(BinaryExprAST* e) { dispatch(e->LHS); dispatch(e->RHS); }
+//      ...
+//  };
+//
+//dispatch() switches on the kind stored in the node and static_casts to the concrete class. The call
+//to the overload is resolved at compile time (no virtual calls, no dynamic_cast), and a missing
+//overload is a compile error rather than a silent fallthrough.
+//
+//Passes that must handle arbitrarily deep trees keep their own stack of per-node frames and pass the
+//frame through dispatch() instead of recursing; see Code_Gen::codegen.
+template <typename Derived, typename RetTy>
+class ASTVisitor {
+
+	public:
+
+	//nodes the ids handed to dispatch() refer to
+	ASTContext &ast;
+
+	ASTVisitor(ASTContext &_ast) : ast(_ast) {}
+
+	//Extra arguments are passed on to visit() unchanged, e.g. per-node state of an iterative pass
+	template <typename ...Args>
+	RetTy dispatch(ExprId id, Args&& ...args)
+	{
+		ExprAST* node = ast.get(id);
+		Derived* pass = static_cast<Derived*>(this);
+		switch (node->getType())
+		{
+			case exprTypeNumber: return pass->visit(static_cast<NumberExprAST*>(node), args...);
+			case exprTypeVariable: return pass->visit(static_cast<VariableExprAST*>(node), args...);
+			case exprTypeBinaryExpr: return pass->visit(static_cast<BinaryExprAST*>(node), args...);
+			case exprTypeIf: return pass->visit(static_cast<IfExprAST*>(node), args...);
+			case exprTypeFor: return pass->visit(static_cast<ForExprAST*>(node), args...);
+			case exprTypeFunc: return pass->visit(static_cast<FunctionAST*>(node), args...);
+			case exprTypePrototype: return pass->visit(static_cast<PrototypeAST*>(node), args...);
+			case exprTypeCall: return pass->visit(static_cast<CallExprAST*>(node), args...);
+			case exprTypeVarExpr: return pass->visit(static_cast<VarExprAST*>(node), args...);
+			case exprTypeUnary: return pass->visit(static_cast<UnaryExprAST*>(node), args...);
+			default: break;
+		}
+		return pass->visitInvalid(node, args...);
+	}
+
+	//Called for a node with an unknown kind; passes may override
+	template <typename ...Args>
+	RetTy visitInvalid(ExprAST* /*node*/, Args&& .../*args*/) { return RetTy(); }
+};
+
+}
+
+#endif
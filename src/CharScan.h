@@ -0,0 +1,249 @@
+#ifndef CHARSCAN_DEFINED
+#define CHARSCAN_DEFINED
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CHARSCAN_HAVE_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CHARSCAN_HAVE_AVX2 1
+#endif
+
+//Byte classification and bulk scanning helpers for the lexer.
+//Every skip function scans [p, end) and returns the first byte that does not belong to the run (or end).
+namespace charScan {
+
+enum CharClass : uint8_t {
+	ccSpace = 1,
+	ccAlpha = 2,
+	ccDigit = 4,
+	ccDot = 8,
+	ccEOL = 16,
+};
+
+constexpr std::array<uint8_t, 256> makeClassTable()
+{
+	std::array<uint8_t, 256> table = {};
+	table[' '] = table['\t'] = table['\v'] = table['\f'] = ccSpace;
+	table['\n'] = table['\r'] = ccSpace | ccEOL;
+	for (int c = 'a'; c <= 'z'; c++)
+		table[c] = ccAlpha;
+	for (int c = 'A'; c <= 'Z'; c++)
+		table[c] = ccAlpha;
+	for (int c = '0'; c <= '9'; c++)
+		table[c] = ccDigit;
+	table['.'] = ccDot;
+	return table;
+}
+
+constexpr std::array<uint8_t, 256> classTable = makeClassTable();
+
+inline bool is(unsigned char c, uint8_t mask) { return classTable[c] & mask; }
+
+//Scalar tails, also used for the last few bytes of a window
+inline const char* skipScalar(const char* p, const char* end, uint8_t mask)
+{
+	while (p != end && is(*p, mask))
+		++p;
+	return p;
+}
+
+inline const char* findScalar(const char* p, const char* end, uint8_t mask)
+{
+	while (p != end && !is(*p, mask))
+		++p;
+	return p;
+}
+
+#ifdef CHARSCAN_HAVE_SSE2
+//lanes holding c with lo <= c <= lo+span
+inline __m128i inRange16(__m128i v, char lo, char span)
+{
+	__m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(span)), t);
+}
+
+inline __m128i space16(__m128i v)
+{
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange16(v, '\t', '\r' - '\t'));
+}
+
+inline __m128i alnum16(__m128i v)
+{
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	return _mm_or_si128(inRange16(lower, 'a', 'z' - 'a'), inRange16(v, '0', '9' - '0'));
+}
+
+inline __m128i eol16(__m128i v)
+{
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+}
+#endif
+
+#ifdef CHARSCAN_HAVE_AVX2
+inline __m256i inRange32(__m256i v, char lo, char span)
+{
+	__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(span)), t);
+}
+
+inline __m256i space32(__m256i v)
+{
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange32(v, '\t', '\r' - '\t'));
+}
+
+inline __m256i alnum32(__m256i v)
+{
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	return _mm256_or_si256(inRange32(lower, 'a', 'z' - 'a'), inRange32(v, '0', '9' - '0'));
+}
+
+inline __m256i eol32(__m256i v)
+{
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+}
+#endif
+
+inline unsigned countTrailingZeros(uint32_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(x);
+#else
+	unsigned n = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+//One lane classifier per run kind; the SIMD paths test 32 or 16 bytes at a time and the scalar tail uses
+//the class table.
+struct SpaceRun {
+	static const uint8_t mask = ccSpace;
+#ifdef CHARSCAN_HAVE_SSE2
+	static __m128i lanes(__m128i v) { return space16(v); }
+#endif
+#ifdef CHARSCAN_HAVE_AVX2
+	static __m256i lanes(__m256i v) { return space32(v); }
+#endif
+};
+
+struct AlnumRun {
+	static const uint8_t mask = ccAlpha | ccDigit;
+#ifdef CHARSCAN_HAVE_SSE2
+	static __m128i lanes(__m128i v) { return alnum16(v); }
+#endif
+#ifdef CHARSCAN_HAVE_AVX2
+	static __m256i lanes(__m256i v) { return alnum32(v); }
+#endif
+};
+
+struct EOLRun {
+	static const uint8_t mask = ccEOL;
+#ifdef CHARSCAN_HAVE_SSE2
+	static __m128i lanes(__m128i v) { return eol16(v); }
+#endif
+#ifdef CHARSCAN_HAVE_AVX2
+	static __m256i lanes(__m256i v) { return eol32(v); }
+#endif
+};
+
+//Skip == true: advance over bytes of the class. Skip == false: advance to the first byte of the class.
+template <typename Run, bool Skip>
+inline const char* scan(const char* p, const char* end)
+{
+#ifdef CHARSCAN_HAVE_AVX2
+	while (end - p >= 32) {
+		uint32_t bits = (uint32_t)_mm256_movemask_epi8(Run::lanes(_mm256_loadu_si256((const __m256i*)p)));
+		if (Skip)
+			bits = ~bits;
+		if (bits)
+			return p + countTrailingZeros(bits);
+		p += 32;
+	}
+#endif
+#ifdef CHARSCAN_HAVE_SSE2
+	while (end - p >= 16) {
+		uint32_t bits = (uint32_t)_mm_movemask_epi8(Run::lanes(_mm_loadu_si128((const __m128i*)p)));
+		if (Skip)
+			bits = ~bits & 0xFFFF;
+		if (bits)
+			return p + countTrailingZeros(bits);
+		p += 16;
+	}
+#endif
+	return Skip ? skipScalar(p, end, Run::mask) : findScalar(p, end, Run::mask);
+}
+
+inline const char* skipSpace(const char* p, const char* end) { return scan<SpaceRun, true>(p, end); }
+
+inline const char* skipAlnum(const char* p, const char* end) { return scan<AlnumRun, true>(p, end); }
+
+inline const char* findEOL(const char* p, const char* end) { return scan<EOLRun, false>(p, end); }
+
+//Number literals are runs of digits and dots. Clinger's fast path: up to 19 digits fit in a uint64 and,
+//while the mantissa stays below 2^53 and the power of ten below 10^22, a single multiply or divide of
+//two exactly representable doubles is correctly rounded. Anything else goes to strtod.
+inline double parseNumber(const char* p, const char* end)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int fraction = 0;
+	bool seenDot = false;
+	bool fast = true;
+	const char* s = p;
+	for (; s != end; ++s) {
+		if (*s == '.') {
+			if (seenDot)
+				break;
+			seenDot = true;
+			continue;
+		}
+		if (digits == 19) {
+			fast = false;
+			break;
+		}
+		mantissa = mantissa * 10 + (*s - '0');
+		if (mantissa)
+			digits++;
+		if (seenDot)
+			fraction++;
+	}
+
+	if (fast && mantissa <= (uint64_t(1) << 53) && fraction <= 22) {
+		double value = (double)mantissa;
+		return fraction ? value / pow10[fraction] : value;
+	}
+
+	//strtod stops at the same place the fast path does (second '.')
+	size_t len = end - p;
+	char numBuf[128];
+	if (len < sizeof(numBuf)) {
+		memcpy(numBuf, p, len);
+		numBuf[len] = 0;
+		return strtod(numBuf, 0);
+	}
+	char* heapBuf = (char*)malloc(len + 1);
+	memcpy(heapBuf, p, len);
+	heapBuf[len] = 0;
+	double value = strtod(heapBuf, 0);
+	free(heapBuf);
+	return value;
+}
+
+}
+
+#endif
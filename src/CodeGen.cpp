@@ -23,239 +23,703 @@
 #define CODEGEN_DEFINED
 #endif
 
+#include "Stats.h"
+
 
 
 namespace myCompiler{
 
-	Code_Gen::Code_Gen(bool _printLog)
+	Code_Gen::Code_Gen(StringInterner &_symbols, ASTContext &_ast, OperatorTable &_operators) : ASTVisitor(_ast), symbols(_symbols), operators(_operators), integers(_ast)
 	{
 		TheModule = make_unique<Module>("my cool jit", TheContext);
-		printLog = _printLog;
+	}
+
+	Function* Code_Gen::getFunction(SymbolId name)
+	{
+		return name < FunctionsById.size() ? FunctionsById[name] : nullptr;
+	}
+
+	void Code_Gen::setFunction(SymbolId name, Function* F)
+	{
+		if (name >= FunctionsById.size())
+			FunctionsById.resize(name + 1, nullptr);
+		FunctionsById[name] = F;
+	}
+	
+	void Code_Gen::moveToEnd(Function* F)
+	{
+		auto body = memoBodies.find(F);
+		if (body != memoBodies.end()) {
+			body->second->removeFromParent();
+			TheModule->getFunctionList().push_back(body->second);
+		}
+		F->removeFromParent();
+		TheModule->getFunctionList().push_back(F);
 	}
 	
-	AllocaInst* Code_Gen::CreateEntryblockAlloca(Function *TheFunction, std::string varName)
+	void Code_Gen::setMemoized(SymbolId name)
+	{
+		if (name >= memoized.size())
+			memoized.resize(name + 1, false);
+		memoized[name] = true;
+	}
+	
+	void Code_Gen::emitMemoWrapper(Function* F, Function* Body)
+	{
+		Type* i64 = Type::getInt64Ty(TheContext);
+		Type* i32 = Type::getInt32Ty(TheContext);
+		unsigned argCount = F->arg_size();
+		
+		//{ argument bits, result, filled }
+		StructType* EntryTy = StructType::get(TheContext, {ArrayType::get(i64, argCount), Type::getDoubleTy(TheContext), Type::getInt8Ty(TheContext)});
+		ArrayType* TableTy = ArrayType::get(EntryTy, memoEntries);
+		GlobalVariable* Table = new GlobalVariable(*TheModule, TableTy, false, GlobalValue::InternalLinkage,
+												   ConstantAggregateZero::get(TableTy), F->getName() + ".memo");
+		
+		BasicBlock* Entry = BasicBlock::Create(TheContext, "entry", F);
+		BasicBlock* Hit = BasicBlock::Create(TheContext, "memo.hit", F);
+		BasicBlock* Miss = BasicBlock::Create(TheContext, "memo.miss", F);
+		Builder.SetInsertPoint(Entry);
+		
+		//multiplicative (Fibonacci) hash of the argument bits; the slot comes from the top bits, which
+		//depend on every input bit (small integers as doubles have all their low bits clear)
+		const uint64_t Multiplier = 0x9E3779B97F4A7C15ull;
+		std::vector<Value*> Bits;
+		Value* Hash = ConstantInt::get(i64, 0);
+		for (auto &Arg : F->args()) {
+			Bits.push_back(Builder.CreateBitCast(&Arg, i64, Arg.getName() + ".bits"));
+			Hash = Builder.CreateMul(Builder.CreateXor(Hash, Bits.back()), ConstantInt::get(i64, Multiplier));
+		}
+		unsigned slotBits = 0;
+		while ((1u << slotBits) < memoEntries)
+			slotBits++;
+		Value* Slot = slotBits ? Builder.CreateLShr(Hash, 64 - slotBits, "memo.slot") : ConstantInt::get(i64, 0);
+		Value* EntryPtr = Builder.CreateInBoundsGEP(TableTy, Table, {ConstantInt::get(i64, 0), Slot}, "memo.entry");
+		
+		Value* Filled = Builder.CreateLoad(Type::getInt8Ty(TheContext), Builder.CreateStructGEP(EntryTy, EntryPtr, 2));
+		Value* Match = Builder.CreateICmpNE(Filled, ConstantInt::get(Type::getInt8Ty(TheContext), 0));
+		for (unsigned i = 0; i < argCount; i++) {
+			Value* KeyPtr = Builder.CreateInBoundsGEP(EntryTy, EntryPtr, {ConstantInt::get(i32, 0), ConstantInt::get(i32, 0), ConstantInt::get(i32, i)});
+			Value* Key = Builder.CreateLoad(i64, KeyPtr);
+			Match = Builder.CreateAnd(Match, Builder.CreateICmpEQ(Key, Bits[i]));
+		}
+		Value* ResultPtr = Builder.CreateStructGEP(EntryTy, EntryPtr, 1);
+		Builder.CreateCondBr(Match, Hit, Miss);
+		
+		Builder.SetInsertPoint(Hit);
+		Builder.CreateRet(Builder.CreateLoad(Type::getDoubleTy(TheContext), ResultPtr, "memo.value"));
+		
+		Builder.SetInsertPoint(Miss);
+		std::vector<Value*> Args;
+		for (auto &Arg : F->args())
+			Args.push_back(&Arg);
+		Value* Result = Builder.CreateCall(Body, Args, "memo.call");
+		for (unsigned i = 0; i < argCount; i++) {
+			Value* KeyPtr = Builder.CreateInBoundsGEP(EntryTy, EntryPtr, {ConstantInt::get(i32, 0), ConstantInt::get(i32, 0), ConstantInt::get(i32, i)});
+			Builder.CreateStore(Bits[i], KeyPtr);
+		}
+		Builder.CreateStore(Result, ResultPtr);
+		Builder.CreateStore(ConstantInt::get(Type::getInt8Ty(TheContext), 1), Builder.CreateStructGEP(EntryTy, EntryPtr, 2));
+		Builder.CreateRet(Result);
+		
+		memoBodies[F] = Body;
+		KTRACE(traceCodegen, traceInfo, "memoized function", "name", F->getName().str(), "entries", memoEntries);
+	}
+	
+	AllocaInst* Code_Gen::CreateEntryblockAlloca(Function *TheFunction, std::string varName, Type* type)
 	{
 		llvm::IRBuilder<> TmpBuilder(&(TheFunction->getEntryBlock()), TheFunction->getEntryBlock().begin());
-		return TmpBuilder.CreateAlloca(Type::getDoubleTy(TheContext), 0, varName.c_str());
+		return TmpBuilder.CreateAlloca(type ? type : Type::getDoubleTy(TheContext), 0, varName.c_str());
 	}
 	
-	Value* Code_Gen::codegen(NumberExprAST* numExprAST)
+	bool Code_Gen::isIntegerOperand(ExprId id)
 	{
-		return llvm::ConstantFP::get(TheContext, APFloat(numExprAST->Val));
+		int64_t value;
+		if (integers.isInteger(id, value))
+			return true;
+		VariableExprAST* var = ast.asOrNull<VariableExprAST>(id);
+		Value* V = var ? NamedValues.lookup(var->Name) : nullptr;
+		return V && isIntegerVariable(V);
 	}
 	
-	Value*  Code_Gen::codegen(VariableExprAST* variableExprAST)
+	bool Code_Gen::isIntegerVariable(Value* V) const
 	{
-		Value* V = NamedValues[variableExprAST->Name];
-		std::string msg = "VariableExprAST::codegen() ";
-		msg += variableExprAST->Name;
-		CodegenLog(msg);
-		if (!V) {
-			CodegenLog("Unknown variable name " + variableExprAST->Name);
+		AllocaInst* Slot = dyn_cast<AllocaInst>(V);
+		return Slot ? isIntegerSlot(Slot) : V->getType()->isIntegerTy();
+	}
+	
+	Value* Code_Gen::integerOperand(ExprId id)
+	{
+		int64_t value;
+		if (integers.isInteger(id, value))
+			return ConstantInt::get(Type::getInt64Ty(TheContext), value);
+		VariableExprAST* var = ast.as<VariableExprAST>(id);
+		Value* V = NamedValues.lookup(var->Name);
+		AllocaInst* Slot = dyn_cast<AllocaInst>(V);
+		return Slot ? Builder.CreateLoad(Slot->getAllocatedType(), Slot, getName(var->Name) + ".int") : V;
+	}
+	
+	CodegenStep Code_Gen::visit(NumberExprAST* numExprAST, CodegenFrame &/*frame*/, Value* /*child*/)
+	{
+		return finish(llvm::ConstantFP::get(TheContext, APFloat(numExprAST->Val)));
+	}
+	
+	CodegenStep Code_Gen::visit(VariableExprAST* variableExprAST, CodegenFrame &/*frame*/, Value* /*child*/)
+	{
+		Value* Bound = NamedValues.lookup(variableExprAST->Name);
+		KTRACE(traceCodegen, traceDebug, "VariableExprAST::codegen()", "name", symbols.str(variableExprAST->Name));
+		if (!Bound) {
+			KTRACE(traceCodegen, traceError, "Unknown variable name", "name", symbols.str(variableExprAST->Name));
+			return finish(nullptr);
 		}
 		
-		return Builder.CreateLoad(V, (variableExprAST->Name).c_str());
+		AllocaInst* V = dyn_cast<AllocaInst>(Bound);
+		if (!V) {
+			if (Bound->getType()->isIntegerTy())
+				return finish(Builder.CreateSIToFP(Bound, Type::getDoubleTy(TheContext), getName(variableExprAST->Name)));
+			return finish(Bound);
+		}
+		if (isIntegerSlot(V)) {
+			Value* Int = Builder.CreateLoad(V->getAllocatedType(), V, getName(variableExprAST->Name) + ".int");
+			return finish(Builder.CreateSIToFP(Int, Type::getDoubleTy(TheContext), getName(variableExprAST->Name)));
+		}
+		return finish(Builder.CreateLoad(V->getAllocatedType(), V, getName(variableExprAST->Name)));
 	}
 	
-	Value*  Code_Gen::codegen(BinaryExprAST* binaryExprAST)
+	CodegenStep Code_Gen::visit(BinaryExprAST* binaryExprAST, CodegenFrame &frame, Value* child)
 	{
 		if (binaryExprAST->op == '=')
 		{
+			VariableExprAST *LHSE = ast.asOrNull<VariableExprAST>(binaryExprAST->LHS);
 			
-			VariableExprAST *LHSE = dynamic_cast<VariableExprAST*>((binaryExprAST->LHS).get());
-			
-			if (!LHSE) {
-				CodegenLog("ERROR: destination of '=' must be a variable");
-				return nullptr;
+			if (frame.step == 0) {
+				if (!LHSE) {
+					KTRACE(traceCodegen, traceError, "destination of '=' must be a variable");
+					return finish(nullptr);
+				}
+				//an integer counter: IntegerInference only allows 'c = c + k' on it
+				AllocaInst* Slot = dyn_cast_or_null<AllocaInst>(NamedValues.lookup(LHSE->getName()));
+				int64_t delta;
+				if (Slot && isIntegerSlot(Slot) && integers.counterStep(binaryExprAST->RHS, LHSE->getName(), delta)) {
+					Value* Old = Builder.CreateLoad(Slot->getAllocatedType(), Slot, getName(LHSE->getName()) + ".int");
+					Value* New = Builder.CreateAdd(Old, ConstantInt::get(Slot->getAllocatedType(), delta), "counttmp", false, true);
+					Builder.CreateStore(New, Slot);
+					forgetValues();
+					return finish(Builder.CreateSIToFP(New, Type::getDoubleTy(TheContext)));
+				}
+				frame.step = 1;
+				return descend(binaryExprAST->RHS);
 			}
 			
-			Value *R = codegen(binaryExprAST->RHS);
+			Value *R = child;
 			if (!R)
-				return nullptr;
+				return finish(nullptr);
 			
-			Value *L = NamedValues[LHSE->getName()];
+			//isAssigned() gave the variable a slot
+			Value *L = dyn_cast_or_null<AllocaInst>(NamedValues.lookup(LHSE->getName()));
 			if (!L) {
-				CodegenLog("ERROR: Unknown variable name");
+				KTRACE(traceCodegen, traceError, "Unknown variable name", "name", symbols.str(LHSE->getName()));
+				return finish(nullptr);
 			}
 			
 			Builder.CreateStore(R, L);
+			forgetValues();
+			
+			return finish(R); //Returning a value allows for chained assignments like “X = (Y = Z)”
+		}
+		
+		//accumulator site: fold the other operand into the accumulator, then loop through the self call
+		int callSide = frame.tail ? accumulatorOperand(binaryExprAST) : -1;
+		if (callSide >= 0) {
+			ExprId call = callSide ? binaryExprAST->RHS : binaryExprAST->LHS;
+			ExprId other = callSide ? binaryExprAST->LHS : binaryExprAST->RHS;
+			switch (frame.step)
+			{
+				case 0:
+					frame.step = 1;
+					return descend(other);
+				case 1:
+				{
+					if (!child)
+						return finish(nullptr);
+					Value* Acc = Builder.CreateLoad(Type::getDoubleTy(TheContext), accumulator, "acc");
+					Value* Next = accumulatorOp == '*' ? Builder.CreateFMul(Acc, child, "acc.next") : Builder.CreateFAdd(Acc, child, "acc.next");
+					Builder.CreateStore(Next, accumulator);
+					accumulatorSites++;
+					frame.step = 2;
+					return descendTail(call);
+				}
+				default:
+					return finish(child);
+			}
+		}
+		
+		//comparison of integer variables and literals
+		if ((binaryExprAST->op == '<' || binaryExprAST->op == '>') && frame.step == 0 &&
+			(ast.asOrNull<VariableExprAST>(binaryExprAST->LHS) || ast.asOrNull<VariableExprAST>(binaryExprAST->RHS)) &&
+			isIntegerOperand(binaryExprAST->LHS) && isIntegerOperand(binaryExprAST->RHS)) {
+			Value* L = integerOperand(binaryExprAST->LHS);
+			Value* R = integerOperand(binaryExprAST->RHS);
+			return finish(binaryExprAST->op == '<' ? Builder.CreateICmpSLT(L, R, "cmplttmp") : Builder.CreateICmpSGT(L, R, "cmpgrtmp"));
+		}
+		
+		//'&' and '|' only evaluate their right side when the left one does not decide the result. A
+		//right side without calls or assignments is evaluated anyway, and the two combined without a
+		//branch.
+		if (binaryExprAST->op == '&' || binaryExprAST->op == '|') {
+			bool isAnd = binaryExprAST->op == '&';
+			switch (frame.step)
+			{
+				case 0:
+					frame.step = 1;
+					return descendCondition(binaryExprAST->LHS);
+				case 1:
+				{
+					if (!child)
+						return finish(nullptr);
+					Value* L = toCondition(child, "lhscond");
+					frame.values[0] = L;
+					frame.step = 2;
+					if (!isSimple(binaryExprAST->RHS)) {
+						Function *TheFunction = Builder.GetInsertBlock()->getParent();
+						BasicBlock *RHSBB = BasicBlock::Create(TheContext, "logic.rhs", TheFunction);
+						BasicBlock *EndBB = BasicBlock::Create(TheContext, "logic.end");
+						if (isAnd)
+							Builder.CreateCondBr(L, RHSBB, EndBB);
+						else
+							Builder.CreateCondBr(L, EndBB, RHSBB);
+						frame.blocks[0] = Builder.GetInsertBlock();
+						frame.blocks[2] = EndBB;
+						Builder.SetInsertPoint(RHSBB);
+					}
+					return descendCondition(binaryExprAST->RHS);
+				}
+				default:
+					break;
+			}
+			if (!child)
+				return finish(nullptr);
+			Value* L = frame.values[0];
+			Value* R = toCondition(child, "rhscond");
+			BasicBlock *EndBB = frame.blocks[2];
+			if (!EndBB)
+				return finish(isAnd ? Builder.CreateAnd(L, R, "andtmp") : Builder.CreateOr(L, R, "ortmp"));
+			
+			BasicBlock *RHSBB = Builder.GetInsertBlock();
+			Builder.CreateBr(EndBB);
+			RHSBB->getParent()->getBasicBlockList().push_back(EndBB);
+			Builder.SetInsertPoint(EndBB);
 			
-			return R; //Returning a value allows for chained assignments like “X = (Y = Z)”
+			//reached from the left side only when it decided the result
+			PHINode *PN = Builder.CreatePHI(Type::getInt1Ty(TheContext), 2, isAnd ? "andtmp" : "ortmp");
+			PN->addIncoming(ConstantInt::get(Type::getInt1Ty(TheContext), !isAnd), frame.blocks[0]);
+			PN->addIncoming(R, RHSBB);
+			return finish(PN);
 		}
 		
-		Value* L = codegen(binaryExprAST->LHS);
-		Value* R = codegen(binaryExprAST->RHS);
+		switch (frame.step)
+		{
+			case 0:
+				frame.step = 1;
+				return descend(binaryExprAST->LHS);
+			case 1:
+				frame.values[0] = child;
+				frame.generated[0] = !childReused;
+				frame.step = 2;
+				return binaryExprAST->op == ':' && frame.tail ? descendTail(binaryExprAST->RHS) : descend(binaryExprAST->RHS);
+			default:
+				break;
+		}
+		
+		Value* L = frame.values[0];
+		Value* R = child;
+		frame.generated[1] = !childReused;
 		
 		if (!L || !R)
-			return nullptr;
+			return finish(nullptr);
 		
 		switch (binaryExprAST->op)
 		{
 			
 			case '+':
 			{
-				return Builder.CreateFAdd(L, R, "addtmp");
+				if (Value* Fused = functionContract == fpContractOn ? fuseMulAdd(binaryExprAST, frame, L, R) : nullptr)
+					return finish(Fused);
+				return finish(Builder.CreateFAdd(L, R, "addtmp"));
 			}
 			case '-':
 			{
-				return Builder.CreateFSub(L, R, "subtmp");
+				if (Value* Fused = functionContract == fpContractOn ? fuseMulAdd(binaryExprAST, frame, L, R) : nullptr)
+					return finish(Fused);
+				return finish(Builder.CreateFSub(L, R, "subtmp"));
 			}
 			case '*':
 			{
-				return Builder.CreateFMul(L, R, "multmp");
+				return finish(Builder.CreateFMul(L, R, "multmp"));
+			}
+			case '/':
+			{
+				return finish(Builder.CreateFDiv(L, R, "divtmp"));
 			}
 			case '<':
 			{
-				Value* result = Builder.CreateFCmpULT(L, R, "cmplttmp");
-				return Builder.CreateUIToFP(result, Type::getDoubleTy(TheContext));
+				return finish(Builder.CreateFCmpULT(L, R, "cmplttmp"));
 			}
 			case '>':
 			{
-				Value* result = Builder.CreateFCmpUGE(L, R, "cmpgrtmp");
-				return Builder.CreateUIToFP(result, Type::getDoubleTy(TheContext));
+				return finish(Builder.CreateFCmpUGT(L, R, "cmpgrtmp"));
 			}
 			case ':':
 			{
-				return R; //return this just so as to not return nullptr
+				return finish(R); //return this just so as to not return nullptr
 			}
 			default:
-			{
-				CodegenLog("ERROR: Invalid binary operator");
-				return nullptr;
-			}
+				break;
 		}
 
+		//user-defined operator: call the function declared with 'def binary<op>'
+		Function *F = operators.hasBinaryFunction(binaryExprAST->op) ? getFunction(operators.binaryFunction(binaryExprAST->op)) : nullptr;
+		if (!F) {
+			KTRACE(traceCodegen, traceError, "Invalid binary operator", "op", operators.spelling(binaryExprAST->op));
+			return finish(nullptr);
+		}
+		Value *Ops[] = {L, R};
+		return finish(Builder.CreateCall(F, Ops, "binop"));
 	}
 	
-	Value*  Code_Gen::codegen(CallExprAST* callExprAST) 
+	CodegenStep Code_Gen::visit(UnaryExprAST* unaryExprAST, CodegenFrame &frame, Value* child)
 	{
-	  // Look up the name in the global module table.
-	  Function *CalleeF = TheModule->getFunction(callExprAST->Callee);
-	  if (!CalleeF) {
-		CodegenLog("ERROR: Unknown function referenced");
-		return nullptr;
-	  }
+		if (frame.step == 0) {
+			frame.step = 1;
+			return descend(unaryExprAST->Operand);
+		}
+		
+		Value *OperandV = child;
+		if (!OperandV)
+			return finish(nullptr);
+		
+		Function *F = operators.hasUnaryFunction(unaryExprAST->op) ? getFunction(operators.unaryFunction(unaryExprAST->op)) : nullptr;
+		if (!F) {
+			KTRACE(traceCodegen, traceError, "Unknown unary operator", "op", operators.spelling(unaryExprAST->op));
+			return finish(nullptr);
+		}
+		return finish(Builder.CreateCall(F, OperandV, "unop"));
+	}
+	
+	CodegenStep Code_Gen::visit(CallExprAST* callExprAST, CodegenFrame &frame, Value* child)
+	{
+	  auto Args = ast.exprList(callExprAST->Args);
+	  // arguments of this call start at argValues[frame.index]
+	  if (frame.step == 0) {
+		// Look up the callee in the function table.
+		Function *CalleeF = getFunction(callExprAST->Callee);
+		if (!CalleeF) {
+		  KTRACE(traceCodegen, traceError, "Unknown function referenced", "name", symbols.str(callExprAST->Callee));
+		  return finish(nullptr);
+		}
 
-	  // If argument mismatch error.
-	  auto Args = callExprAST->Args;
-	  if (CalleeF->arg_size() != Args.size()) {
-		CodegenLog("ERROR: Incorrect # arguments passed");
-		return nullptr;
+		// If argument mismatch error.
+		if (CalleeF->arg_size() != Args.size()) {
+		  KTRACE(traceCodegen, traceError, "Incorrect # arguments passed", "name", symbols.str(callExprAST->Callee));
+		  return finish(nullptr);
+		}
+		
+		frame.values[0] = CalleeF;
+		frame.index = argValues.size();
+		frame.step = 1;
 	  }
+	  else {
+		if (!child) {
+		  argValues.resize(frame.index);
+		  return finish(nullptr);
+		}
+		argValues.push_back(child);
+	  }
+
+	  size_t done = argValues.size() - frame.index;
+	  if (done < Args.size())
+		return descend(Args[done]);
 
-	  std::vector<Value *> ArgsV;
-	  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-		ArgsV.push_back(codegen(callExprAST->Args[i]));
-		if (!ArgsV.back())
-		  return nullptr;
+	  Function* CalleeF = cast<Function>(frame.values[0]);
+	  if (frame.tail && tailHeader && CalleeF == tailFunction) {
+		//self call in tail position: new parameter values, then back to the top
+		for (size_t i = 0; i < done; i++) {
+		  if (PHINode* Param = dyn_cast<PHINode>(tailParams[i]))
+			Param->addIncoming(argValues[frame.index + i], Builder.GetInsertBlock());
+		  else
+			Builder.CreateStore(argValues[frame.index + i], tailParams[i]);
+		}
+		argValues.resize(frame.index);
+		Builder.CreateBr(tailHeader);
+		forgetValues();
+		tailCallsLooped++;
+		//the parent's code after this point is unreachable
+		Builder.SetInsertPoint(BasicBlock::Create(TheContext, "aftertail", CalleeF));
+		return finish(UndefValue::get(Type::getDoubleTy(TheContext)));
 	  }
 
-	  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+	  CallInst* call = Builder.CreateCall(CalleeF, makeArrayRef(argValues.data() + frame.index, done), "calltmp");
+	  argValues.resize(frame.index);
+	  if (frame.tail) {
+		call->setTailCall();
+		tailCallsMarked++;
+	  }
+	  return finish(call);
 	}
 	
-	Function*  Code_Gen::codegen(PrototypeAST* protoExprAST)
+	Function*  Code_Gen::declare(PrototypeAST* protoExprAST)
 	{
 		
-		std::vector<Type*> Doubles(protoExprAST->Args.size(), Type::getDoubleTy(TheContext));
+		auto Args = ast.symbolList(protoExprAST->Args);
+		//a repeated declaration refers to the function already declared
+		Function *Existing = protoExprAST->Anonymous ? nullptr : getFunction(protoExprAST->Name);
+		if (Existing && Existing->arg_size() == Args.size())
+			return Existing;
+		
+		std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(TheContext));
 		FunctionType* FT = FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
 		
-		Function *F = Function::Create(FT, Function::ExternalLinkage, protoExprAST->Name, TheModule.get());
+		std::string fnName = protoExprAST->Anonymous ? "" : getName(protoExprAST->Name);
+		Function *F = Function::Create(FT, protoExprAST->Internal ? Function::InternalLinkage : Function::ExternalLinkage,
+									 fnName, TheModule.get());
+		if (!protoExprAST->Anonymous)
+			setFunction(protoExprAST->Name, F);
 		
 		//Set name of each argument, not necessary but make IR more readable
 		int id = 0;
 		for (auto &Arg : F->args())
-			Arg.setName(protoExprAST->Args[id++]);
+			Arg.setName(getName(Args[id++]));
 		
 		return F;
 	}
 	
-	Function*  Code_Gen::codegen(FunctionAST* fnExprAST)
+	CodegenStep Code_Gen::visit(PrototypeAST* protoExprAST, CodegenFrame &/*frame*/, Value* /*child*/)
 	{
-		CodegenLog("Function.codegen()");
-		Function* TheFunction = TheModule->getFunction((fnExprAST->Proto)->getName());
-		
-		if (!TheFunction)
-		{
-			PrototypeAST *protoExprAST = dynamic_cast<PrototypeAST*>((fnExprAST->Proto).get());
-			TheFunction = codegen(protoExprAST);
-		}
-		
-		if (!TheFunction)
-			return nullptr;
-		
-		if (!TheFunction->empty())
-			CodegenLog("ERROR: Function cannot be redifined");
-		
-		BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-		Builder.SetInsertPoint(BB);
+		return finish(declare(protoExprAST));
+	}
+	
+	CodegenStep Code_Gen::visit(FunctionAST* fnExprAST, CodegenFrame &frame, Value* child)
+	{
+		PrototypeAST *protoExprAST = ast.as<PrototypeAST>(fnExprAST->Proto);
 		
-		NamedValues.clear();
-		for (auto &Arg : TheFunction->args()) {
-			CodegenLog("Adding argument to NamedValues " + std::string(Arg.getName()));
-			AllocaInst *ArgAlloca = CreateEntryblockAlloca(TheFunction, Arg.getName());
+		if (frame.step == 0) {
+			KTRACE(traceCodegen, traceDebug, "Function.codegen()", "name", symbols.str(protoExprAST->getName()));
+			Function* TheFunction = protoExprAST->Anonymous ? nullptr : getFunction(protoExprAST->getName());
+			
+			if (!TheFunction)
+				TheFunction = declare(protoExprAST);
+			
+			if (!TheFunction)
+				return finish(nullptr);
 			
-			Builder.CreateStore(&Arg, ArgAlloca);
+			if (!TheFunction->empty())
+				KTRACE(traceCodegen, traceError, "Function cannot be redifined", "name", symbols.str(protoExprAST->getName()));
 			
-			NamedValues[Arg.getName()] = ArgAlloca;
+			//the definition of a memoized function goes into its body function
+			Function* BodyFunction = TheFunction;
+			if (!protoExprAST->Anonymous && isMemoized(protoExprAST->Name) && TheFunction->empty() &&
+				TheFunction->arg_size() >= 1 && TheFunction->arg_size() <= MaxMemoArgs) {
+				BodyFunction = Function::Create(TheFunction->getFunctionType(), Function::InternalLinkage, TheFunction->getName() + ".body");
+				TheModule->getFunctionList().insert(TheFunction->getIterator(), BodyFunction);
+			}
+			
+			BasicBlock *BB = BasicBlock::Create(TheContext, "entry", BodyFunction);
+			Builder.SetInsertPoint(BB);
+			setFloatMode(protoExprAST);
+			
+			NamedValues.clear();
+			tailParams.clear();
+			if (inferIntegers)
+				integers.run(fnExprAST->Body);
+			else
+				integers.clear();
+			scanAssignments(fnExprAST->Body);
+			
+			//assigned parameters live in slots, the others are the argument itself
+			auto ArgNames = ast.symbolList(protoExprAST->Args);
+			int argIdx = 0;
+			for (auto &Arg : BodyFunction->args()) {
+				SymbolId argName = ArgNames[argIdx++];
+				KTRACE(traceCodegen, traceDebug, "Adding argument to NamedValues", "name", symbols.str(argName));
+				if (BodyFunction != TheFunction)
+					Arg.setName(getName(argName));
+				if (!isAssigned(argName)) {
+					ssaVariables++;
+					NamedValues.bind(argName, &Arg);
+					tailParams.push_back(&Arg);
+					continue;
+				}
+				AllocaInst *ArgAlloca = CreateEntryblockAlloca(BodyFunction, getName(argName));
+				
+				Builder.CreateStore(&Arg, ArgAlloca);
+				
+				NamedValues.bind(argName, ArgAlloca);
+				tailParams.push_back(ArgAlloca);
+			}
+			forgetValues();
+			
+			//a memoized function's self calls go through the wrapper, so they stay calls
+			tailSelf = protoExprAST->Name;
+			tailFunction = nullptr;
+			tailHeader = nullptr;
+			accumulator = nullptr;
+			accumulatorOp = 0;
+			if (!protoExprAST->Anonymous && BodyFunction == TheFunction && scanTailCalls(fnExprAST->Body)) {
+				tailFunction = TheFunction;
+				if (accumulatorOp) {
+					accumulator = CreateEntryblockAlloca(BodyFunction, "acc");
+					Builder.CreateStore(ConstantFP::get(TheContext, APFloat(accumulatorOp == '*' ? 1.0 : 0.0)), accumulator);
+				}
+				BasicBlock* EntryBB = Builder.GetInsertBlock();
+				tailHeader = BasicBlock::Create(TheContext, "tailrecurse", BodyFunction);
+				Builder.CreateBr(tailHeader);
+				Builder.SetInsertPoint(tailHeader);
+				//a parameter without a slot takes the new values of the self tail calls through a phi
+				for (size_t i = 0; i < tailParams.size(); i++) {
+					if (!isa<Argument>(tailParams[i]))
+						continue;
+					PHINode* Param = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, getName(ArgNames[i]));
+					Param->addIncoming(tailParams[i], EntryBB);
+					NamedValues.bind(ArgNames[i], Param);
+					tailParams[i] = Param;
+				}
+			}
+			
+			frame.values[0] = TheFunction;
+			frame.values[1] = BodyFunction;
+			frame.step = 1;
+			return descendTail(fnExprAST->Body);
 		}
 		
-		if (Value* retVal = codegen(fnExprAST->Body))
+		Function* TheFunction = cast<Function>(frame.values[0]);
+		Function* BodyFunction = cast<Function>(frame.values[1]);
+		AllocaInst* Accumulator = accumulator;
+		tailFunction = nullptr;
+		tailHeader = nullptr;
+		accumulator = nullptr;
+		if (Value* retVal = child)
 		{
+			if (Accumulator) {
+				Value* Acc = Builder.CreateLoad(Type::getDoubleTy(TheContext), Accumulator, "acc");
+				retVal = accumulatorOp == '*' ? Builder.CreateFMul(Acc, retVal, "acc.result") : Builder.CreateFAdd(Acc, retVal, "acc.result");
+			}
 			Builder.CreateRet(retVal);
 			
+			if (BodyFunction != TheFunction) {
+				verifyFunction(*BodyFunction);
+				emitMemoWrapper(TheFunction, BodyFunction);
+				addTargetAttributes(BodyFunction);
+				addFloatAttributes(BodyFunction);
+			}
+			addTargetAttributes(TheFunction);
+			addFloatAttributes(TheFunction);
+			Builder.clearFastMathFlags();
 			verifyFunction(*TheFunction);
 			
-			return TheFunction;
+			return finish(TheFunction);
 		}
 		
+		if (!protoExprAST->Anonymous)
+			setFunction(protoExprAST->getName(), nullptr);
+		if (BodyFunction != TheFunction)
+			BodyFunction->eraseFromParent();
 		TheFunction->eraseFromParent();
-		return nullptr;
+		Builder.clearFastMathFlags();
+		return finish(nullptr);
 	}
 
-	Value*  Code_Gen::codegen(IfExprAST* ifExprAST)
+	CodegenStep Code_Gen::visit(IfExprAST* ifExprAST, CodegenFrame &frame, Value* child)
 	{
-		Value *CondV = codegen(ifExprAST->Cond); 
-		if (!CondV)
-			return nullptr;
-		
-		CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
-		
-		Function *TheFunction = Builder.GetInsertBlock()->getParent();
-		
-		BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-		BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-		BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
-		
-		Builder.CreateCondBr(CondV, ThenBB, ElseBB);
-		
-		//set insert point to ThenBB
-		Builder.SetInsertPoint(ThenBB);
-		
-		//codegen ThenBB
-		Value *ThenV = codegen(ifExprAST->Then);
-		if (!ThenV)
-			return nullptr;
-		
-		//add branch to MergeBB
-		Builder.CreateBr(MergeBB);
-		
-		ThenBB = Builder.GetInsertBlock();
-		
-		TheFunction->getBasicBlockList().push_back(ElseBB);
-		//set insert point to ElseBB
-		Builder.SetInsertPoint(ElseBB);
+		switch (frame.step)
+		{
+			case 0:
+			{
+				frame.step = 1;
+				return descendCondition(ifExprAST->Cond);
+			}
+			case 1:
+			{
+				Value *CondV = child;
+				if (!CondV)
+					return finish(nullptr);
+				
+				CondV = toCondition(CondV, "ifcond");
+				
+				if (useSelect(ifExprAST)) {
+					frame.values[1] = CondV;
+					frame.step = 4;
+					return descend(ifExprAST->Then);
+				}
+				
+				Function *TheFunction = Builder.GetInsertBlock()->getParent();
+				
+				BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
+				BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
+				BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+				
+				Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+				
+				//set insert point to ThenBB
+				Builder.SetInsertPoint(ThenBB);
+				
+				frame.blocks[1] = ElseBB;
+				frame.blocks[2] = MergeBB;
+				frame.step = 2;
+				//codegen ThenBB
+				return frame.tail ? descendTail(ifExprAST->Then) : descend(ifExprAST->Then);
+			}
+			case 2:
+			{
+				Value *ThenV = child;
+				if (!ThenV)
+					return finish(nullptr);
+				
+				//add branch to MergeBB
+				Builder.CreateBr(frame.blocks[2]);
+				
+				frame.values[0] = ThenV;
+				frame.blocks[0] = Builder.GetInsertBlock();
+				
+				Function *TheFunction = Builder.GetInsertBlock()->getParent();
+				TheFunction->getBasicBlockList().push_back(frame.blocks[1]);
+				//set insert point to ElseBB
+				Builder.SetInsertPoint(frame.blocks[1]);
+				
+				frame.step = 3;
+				//codegen ElseBB
+				return frame.tail ? descendTail(ifExprAST->Else) : descend(ifExprAST->Else);
+			}
+			case 4:
+			{
+				//if-converted: both arms go into the current block
+				if (!child)
+					return finish(nullptr);
+				frame.values[0] = child;
+				frame.step = 5;
+				return descend(ifExprAST->Else);
+			}
+			case 5:
+			{
+				if (!child)
+					return finish(nullptr);
+				selectsEmitted++;
+				return finish(Builder.CreateSelect(frame.values[1], frame.values[0], child, "iftmp"));
+			}
+			default:
+				break;
+		}
 		
-		//codegen ElseBB
-		Value *ElseV = codegen(ifExprAST->Else);
+		Value *ElseV = child;
 		
 		if (!ElseV)
-			return nullptr;
+			return finish(nullptr);
 		
+		BasicBlock *MergeBB = frame.blocks[2];
 		//add branch to MergeBB
 		Builder.CreateBr(MergeBB);
 		
-		ElseBB = Builder.GetInsertBlock();
-		TheFunction->getBasicBlockList().push_back(MergeBB);
+		BasicBlock *ElseBB = Builder.GetInsertBlock();
+		ElseBB->getParent()->getBasicBlockList().push_back(MergeBB);
 		
 		//set insert point to MergeBB
 		Builder.SetInsertPoint(MergeBB);
@@ -263,199 +727,635 @@ namespace myCompiler{
 		//add phi to merge values from ThenBB and ElseBB
 		PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
 		
-		PN->addIncoming(ThenV, ThenBB);
+		PN->addIncoming(frame.values[0], frame.blocks[0]);
 		PN->addIncoming(ElseV, ElseBB);
 		
-		return PN;
+		return finish(PN);
 	}
 	
-	Value*  Code_Gen::codegen(ForExprAST* forExprAST)
+	CodegenStep Code_Gen::visit(ForExprAST* forExprAST, CodegenFrame &frame, Value* child)
 	{
-		Function *TheFunction = Builder.GetInsertBlock()->getParent();
-		
-		//code gen start value
-		AllocaInst* InductionVar = CreateEntryblockAlloca(TheFunction, forExprAST->InductionVarName);
-		
-		Value* StartV = codegen(forExprAST->Start);
-		if (!StartV)
-			return nullptr;
-		
-		Builder.CreateStore(StartV, InductionVar);
-		
-		//get current function and basic block (it can get modified by Start->codegen() )
-		
-		BasicBlock *PreHeaderBB = Builder.GetInsertBlock();
-		
-		//add new block (loop) 
-		BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
-		
-		//unconditional branch to loop block
-		Builder.CreateBr(LoopBB);
-		
-		Builder.SetInsertPoint(LoopBB);
-		
-		//add phi instruction to update induction variable
-		//PHINode *InductionVar = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "loop");
-		//InductionVar->addIncoming(StartV, PreHeaderBB);
-		
-		//Error out if induction variable has been defined earlier
-		if (NamedValues.find(forExprAST->InductionVarName) != NamedValues.end()) {
-			CodegenLog("ERROR: Redefinition of variable in for loop");
-			return nullptr;
-		}		
-		NamedValues[forExprAST->InductionVarName] = InductionVar;
-		
-		
-		//codegen body of loop
-		if (!(codegen(forExprAST->Body)))
-			return nullptr;
-		
-		//codegen increment
-		Value *StepV = codegen(forExprAST->Step);
-		
-		if (!StepV)
-			return nullptr;
-		
-		//increment induction variable by increment
-		//Value *NextVar = Builder.CreateFAdd(InductionVar, StepV, "nextvar");
-		
-		//increment induction variable by increment
-		Value *Tmp = Builder.CreateLoad(InductionVar);
-		Value *NextVar = Builder.CreateFAdd(Tmp, StepV, "nextvar");
-		Builder.CreateStore(NextVar, InductionVar);
-		
-		//codegen end condition
-		Value *EndCondV = codegen(forExprAST->End);
-		
-		
-		//convert EndV from (0.0 or 1.0) to bool 
-		EndCondV = Builder.CreateFCmpONE(EndCondV, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+		//Guarded and rotated: the end condition is tested with the start value before the loop is
+		//entered, and after every step at the bottom of the body (the only latch)
+		//
+		//  guard:     br end(start), loop.ph, afterloop
+		//  loop.ph:   br loop
+		//  loop:      i = phi [start, loop.ph], [next, latch]; body; next = i + step; br end(next), loop, loop.exit
+		//  loop.exit: br afterloop
+		switch (frame.step)
+		{
+			case 0:
+			{
+				Function *TheFunction = Builder.GetInsertBlock()->getParent();
+				
+				//code gen start value; a variable the body does not assign becomes a phi instead of a slot
+				bool integral = integers.isIntegralLoop(frame.node);
+				if (isAssigned(forExprAST->InductionVarName))
+					frame.alloca = CreateEntryblockAlloca(TheFunction, getName(forExprAST->InductionVarName),
+														  integral ? Type::getInt64Ty(TheContext) : nullptr);
+				
+				frame.step = 1;
+				return descend(forExprAST->Start);
+			}
+			case 1:
+			{
+				Value* StartV = child;
+				if (!StartV)
+					return finish(nullptr);
+				
+				AllocaInst* InductionVar = frame.alloca;
+				if (integers.isIntegralLoop(frame.node))
+					StartV = integerOperand(forExprAST->Start);
+				if (InductionVar)
+					Builder.CreateStore(StartV, InductionVar);
+				
+				//Error out if induction variable has been defined earlier
+				if (NamedValues.lookup(forExprAST->InductionVarName)) {
+					KTRACE(traceCodegen, traceError, "Redefinition of variable in for loop", "name", symbols.str(forExprAST->InductionVarName));
+					return finish(nullptr);
+				}
+				NamedValues.pushScope();
+				NamedValues.bind(forExprAST->InductionVarName, InductionVar ? (Value*)InductionVar : StartV);
+				frame.values[0] = StartV;
+				forgetValues();
+				
+				frame.step = 2;
+				//codegen the guard
+				return descendCondition(forExprAST->End);
+			}
+			case 2:
+			{
+				if (!child) {
+					NamedValues.popScope();
+					forgetValues();
+					return finish(nullptr);
+				}
+				Value* GuardV = toCondition(child, "loopguard");
+				
+				//get current function (blocks can get added by Start and End codegen)
+				Function *TheFunction = Builder.GetInsertBlock()->getParent();
+				BasicBlock *PreheaderBB = BasicBlock::Create(TheContext, "loop.ph", TheFunction);
+				BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+				BasicBlock *AfterLoopBB = BasicBlock::Create(TheContext, "afterloop");
+				Builder.CreateCondBr(GuardV, PreheaderBB, AfterLoopBB);
+				Builder.SetInsertPoint(PreheaderBB);
+				Builder.CreateBr(LoopBB);
+				
+				Builder.SetInsertPoint(LoopBB);
+				frame.blocks[0] = LoopBB;
+				frame.blocks[1] = AfterLoopBB;
+				
+				if (!frame.alloca) {
+					PHINode* Phi = Builder.CreatePHI(frame.values[0]->getType(), 2, getName(forExprAST->InductionVarName));
+					Phi->addIncoming(frame.values[0], PreheaderBB);
+					NamedValues.bind(forExprAST->InductionVarName, Phi);
+					frame.values[0] = Phi;
+					ssaVariables++;
+				}
+				forgetValues();
+				
+				frame.step = 3;
+				//codegen body of loop
+				return descend(forExprAST->Body);
+			}
+			case 3:
+			{
+				if (!child) {
+					NamedValues.popScope();
+					forgetValues();
+					return finish(nullptr);
+				}
+				
+				frame.step = 4;
+				//codegen increment
+				return descend(forExprAST->Step);
+			}
+			case 4:
+			{
+				Value *StepV = child;
+				
+				if (!StepV) {
+					NamedValues.popScope();
+					forgetValues();
+					return finish(nullptr);
+				}
+				
+				//increment induction variable by increment
+				AllocaInst* InductionVar = frame.alloca;
+				Value *Tmp = InductionVar ? Builder.CreateLoad(InductionVar->getAllocatedType(), InductionVar) : frame.values[0];
+				Value *NextVar = integers.isIntegralLoop(frame.node) ? Builder.CreateAdd(Tmp, integerOperand(forExprAST->Step), "nextvar", false, true)
+																	 : Builder.CreateFAdd(Tmp, StepV, "nextvar");
+				if (InductionVar)
+					Builder.CreateStore(NextVar, InductionVar);
+				else {
+					//the end condition sees the incremented value
+					NamedValues.bind(forExprAST->InductionVarName, NextVar);
+					frame.values[1] = NextVar;
+				}
+				forgetValues();
+				
+				frame.step = 5;
+				//codegen end condition
+				return descendCondition(forExprAST->End);
+			}
+			default:
+				break;
+		}
 		
-		//Create BasicBlock after loop
-		BasicBlock *AfterLoopBB = BasicBlock::Create(TheContext, "afterloop", TheFunction);
+		Value *EndCondV = child;
+		NamedValues.popScope();
+		forgetValues();
+		if (!EndCondV)
+			return finish(nullptr);
 		
-		//conditional branch back to loop or afterloop
-		Builder.CreateCondBr(EndCondV, LoopBB, AfterLoopBB);
 		
-		Builder.SetInsertPoint(AfterLoopBB);
+		//a comparison is already an i1
+		EndCondV = toCondition(EndCondV, "loopcond");
 		
+		//the latch: back to the loop or out through a dedicated exit block
+		Function *TheFunction = Builder.GetInsertBlock()->getParent();
+		BasicBlock *ExitBB = BasicBlock::Create(TheContext, "loop.exit", TheFunction);
+		BranchInst* Latch = Builder.CreateCondBr(EndCondV, frame.blocks[0], ExitBB);
+		if (!frame.alloca)
+			cast<PHINode>(frame.values[0])->addIncoming(frame.values[1], Builder.GetInsertBlock());
+		
+		//a loop whose trip count IntegerInference bounds, and that holds nothing that could run forever,
+		//terminates, which lets the optimizer delete it when its effects are unused
+		Metadata* LoopOps[2] = {nullptr, MDNode::get(TheContext, MDString::get(TheContext, "llvm.loop.mustprogress"))};
+		bool finite = integers.isIntegralLoop(frame.node) && alwaysTerminates(forExprAST->Body);
+		MDNode* LoopID = MDNode::getDistinct(TheContext, makeArrayRef(LoopOps, finite ? 2 : 1));
+		LoopID->replaceOperandWith(0, LoopID);
+		Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+		
+		Builder.SetInsertPoint(ExitBB);
+		Builder.CreateBr(frame.blocks[1]);
+		TheFunction->getBasicBlockList().push_back(frame.blocks[1]);
+		Builder.SetInsertPoint(frame.blocks[1]);
 		
 		//for loop always returns 0
-		return Constant::getNullValue(Type::getDoubleTy(TheContext));
+		return finish(Constant::getNullValue(Type::getDoubleTy(TheContext)));
 	}
 	
-	Value*  Code_Gen::codegen(VarExprAST* varExprAST) 
+	CodegenStep Code_Gen::visit(VarExprAST* varExprAST, CodegenFrame &frame, Value* child) 
 	{
 		Function *TheFunction = Builder.GetInsertBlock()->getParent();
-		for (int i = 0; i < varExprAST->VarNames.size(); i++) {
-			std::string name = varExprAST->VarNames[i].first;
-			
-			//Error out if variable has been defined earlier
-			if (NamedValues.find(name) != NamedValues.end()) {
-				CodegenLog("ERROR: Redefinition of variable");
-				return nullptr;
-			}
-			auto init = varExprAST->VarNames[i].second;
-
-			Value* initVal;
-			if (init) {
-				initVal = codegen(init);
-				if (!initVal)
-					return nullptr;	
-			}
-			else {
-				initVal = ConstantFP::get(TheContext, APFloat(0.0));
-			}			
-			
-			AllocaInst* VarAlloca = CreateEntryblockAlloca(TheFunction, name);
-			Builder.CreateStore(initVal, VarAlloca);
-			NamedValues[name] = VarAlloca;
-		}
-		
-		auto *BodyVal = codegen(varExprAST->Body);
-		if (!BodyVal)
-			return nullptr;
+		auto VarNames = ast.varBindingList(varExprAST->VarNames);
 		
-		return BodyVal;
-	}
-	
-	Value* Code_Gen::codegen(std::shared_ptr<ExprAST> exprAST)
-	{
-		ExprType exprType = exprAST->getType();
-		switch (exprType)
+		switch (frame.step)
 		{
-			case exprTypeNumber : 
+			case 0:
+				NamedValues.pushScope();
+				break;
+			case 1:
 			{
-				NumberExprAST *numberExprAST = dynamic_cast<NumberExprAST*>(exprAST.get());
-				return codegen (numberExprAST);
+				//initializer of VarNames[frame.index] is done
+				Value* initVal = child;
+				if (!initVal) {
+					NamedValues.popScope();
+					forgetValues();
+					return finish(nullptr);
+				}
+				SymbolId name = VarNames[frame.index].Name;
+				bool integral = integers.isIntegralBinding(varExprAST->VarNames.first + frame.index);
+				if (integral)
+					initVal = integerOperand(VarNames[frame.index].Init);
+				if (isAssigned(name)) {
+					AllocaInst* VarAlloca = CreateEntryblockAlloca(TheFunction, getName(name), integral ? Type::getInt64Ty(TheContext) : nullptr);
+					Builder.CreateStore(initVal, VarAlloca);
+					NamedValues.bind(name, VarAlloca);
+				}
+				else {
+					NamedValues.bind(name, initVal);
+					ssaVariables++;
+				}
+				forgetValues();
+				frame.index++;
+				break;
 			}
-			
-			
-			case exprTypeVariable :
+			default:
 			{
-				VariableExprAST *varExprAST = dynamic_cast<VariableExprAST*>(exprAST.get());
-				return codegen (varExprAST);
+				NamedValues.popScope();
+				forgetValues();
+				return finish(child);
 			}
+		}
+		
+		for (; frame.index < VarNames.size(); frame.index++) {
+			SymbolId name = VarNames[frame.index].Name;
 			
-			case exprTypeBinaryExpr :
-			{
-				BinaryExprAST *binaryExprAST = dynamic_cast<BinaryExprAST*>(exprAST.get());
-				return codegen (binaryExprAST);
+			//Error out if variable has been defined earlier
+			if (NamedValues.lookup(name)) {
+				KTRACE(traceCodegen, traceError, "Redefinition of variable", "name", symbols.str(name));
+				NamedValues.popScope();
+				forgetValues();
+				return finish(nullptr);
 			}
 			
-			case exprTypeIf :
-			{
-				IfExprAST *ifExprAST = dynamic_cast<IfExprAST*>(exprAST.get());
-				return codegen (ifExprAST);
+			if (auto init = VarNames[frame.index].Init) {
+				frame.step = 1;
+				return descend(init);
 			}
 			
-			case exprTypeCall :
-			{
-				CallExprAST *callExprAST = dynamic_cast<CallExprAST*>(exprAST.get());
-				return codegen (callExprAST);
+			bool integral = integers.isIntegralBinding(varExprAST->VarNames.first + frame.index);
+			Value* initVal = integral ? (Value*)ConstantInt::get(Type::getInt64Ty(TheContext), 0) : ConstantFP::get(TheContext, APFloat(0.0));
+			if (isAssigned(name)) {
+				AllocaInst* VarAlloca = CreateEntryblockAlloca(TheFunction, getName(name), integral ? Type::getInt64Ty(TheContext) : nullptr);
+				Builder.CreateStore(initVal, VarAlloca);
+				NamedValues.bind(name, VarAlloca);
 			}
-			
-			case exprTypePrototype :
-			{
-				PrototypeAST *prototypeExprAST = dynamic_cast<PrototypeAST*>(exprAST.get());
-				return codegen (prototypeExprAST);
+			else {
+				NamedValues.bind(name, initVal);
+				ssaVariables++;
 			}
-			
-			case exprTypeFunc :
-			{
-				FunctionAST *funcExprAST = dynamic_cast<FunctionAST*>(exprAST.get());
-				return codegen (funcExprAST);
+			forgetValues();
+		}
+		
+		frame.step = 2;
+		return frame.tail ? descendTail(varExprAST->Body) : descend(varExprAST->Body);
+	}
+	
+	void Code_Gen::scanAssignments(ExprId body)
+	{
+		assignedNames.clear();
+		std::vector<ExprId> pending(1, body);
+		while (!pending.empty()) {
+			ExprId id = pending.back();
+			pending.pop_back();
+			ExprAST* node = ast.get(id);
+			//Pure nodes hold no assignments
+			if (node->Pure)
+				continue;
+			BinaryExprAST* binary = ast.asOrNull<BinaryExprAST>(id);
+			VariableExprAST* dest = binary && binary->op == '=' ? ast.asOrNull<VariableExprAST>(binary->LHS) : nullptr;
+			if (dest) {
+				if (dest->Name >= assignedNames.size())
+					assignedNames.resize(dest->Name + 1, false);
+				assignedNames[dest->Name] = true;
 			}
-			
-			case exprTypeFor :
-			{
-				ForExprAST *forExprAST = dynamic_cast<ForExprAST*>(exprAST.get());
-				return codegen (forExprAST);
+			ast.forEachChild(node, [&](ExprId &child) { pending.push_back(child); });
+		}
+	}
+	
+	bool Code_Gen::alwaysTerminates(ExprId id) const
+	{
+		std::vector<ExprId> pending(1, id);
+		while (!pending.empty()) {
+			ExprId next = pending.back();
+			pending.pop_back();
+			ExprAST* node = ast.get(next);
+			switch (node->getType()) {
+				case exprTypeCall:
+				case exprTypeUnary:
+					return false;
+				case exprTypeFor:
+					if (!integers.isIntegralLoop(next))
+						return false;
+					break;
+				case exprTypeBinaryExpr:
+					if (!operators.info(static_cast<BinaryExprAST*>(node)->op).builtin)
+						return false;
+					break;
+				default:
+					break;
 			}
-			
-			case exprTypeVarExpr :
-			{
-				VarExprAST *varExprAST = dynamic_cast<VarExprAST*>(exprAST.get());
-				return codegen (varExprAST);
+			ast.forEachChild(node, [&](ExprId &child) { pending.push_back(child); });
+		}
+		return true;
+	}
+	
+	bool Code_Gen::isSelfCall(ExprId id) const
+	{
+		CallExprAST* call = ast.asOrNull<CallExprAST>(id);
+		return call && call->Callee == tailSelf && call->Args.size() == tailParams.size();
+	}
+	
+	bool Code_Gen::isSimple(ExprId id) const
+	{
+		std::vector<ExprId> pending(1, id);
+		while (!pending.empty()) {
+			ExprAST* node = ast.get(pending.back());
+			pending.pop_back();
+			switch (node->getType()) {
+				case exprTypeNumber:
+				case exprTypeVariable:
+					break;
+				case exprTypeBinaryExpr: {
+					BinaryExprAST* binary = static_cast<BinaryExprAST*>(node);
+					if (binary->op == '=' || !operators.info(binary->op).builtin)
+						return false;
+					pending.push_back(binary->LHS);
+					pending.push_back(binary->RHS);
+					break;
+				}
+				default:
+					return false;
 			}
-			
-			default:
-				CodegenLog("ERROR: Uknown expression type");
 		}
-			
+		return true;
+	}
+	
+	unsigned Code_Gen::armCost(ExprId id) const
+	{
+		unsigned cost = 0;
+		std::vector<ExprId> pending(1, id);
+		while (!pending.empty()) {
+			ExprAST* node = ast.get(pending.back());
+			pending.pop_back();
+			switch (node->getType()) {
+				case exprTypeNumber:
+				case exprTypeVariable:
+					break;
+				case exprTypeBinaryExpr: {
+					BinaryExprAST* binary = static_cast<BinaryExprAST*>(node);
+					if (binary->op == '=' || !operators.info(binary->op).builtin)
+						return NotSelectable;
+					cost += binary->op == '/' ? 4 : 1;
+					pending.push_back(binary->LHS);
+					pending.push_back(binary->RHS);
+					break;
+				}
+				default:
+					return NotSelectable;
+			}
+		}
+		return cost;
+	}
+	
+	bool Code_Gen::useSelect(IfExprAST* ifExprAST) const
+	{
+		if (selectIf == selectIfNever)
+			return false;
+		unsigned thenCost = armCost(ifExprAST->Then);
+		unsigned elseCost = armCost(ifExprAST->Else);
+		if (thenCost == NotSelectable || elseCost == NotSelectable)
+			return false;
+		return selectIf == selectIfAlways || thenCost + elseCost <= SelectCostLimit;
+	}
+	
+	int Code_Gen::accumulatorOperand(BinaryExprAST* binaryExprAST) const
+	{
+		if (!accumulatorOp || binaryExprAST->op != accumulatorOp || !tailHeader)
+			return -1;
+		if (isSelfCall(binaryExprAST->RHS) && isSimple(binaryExprAST->LHS))
+			return 1;
+		if (isSelfCall(binaryExprAST->LHS) && isSimple(binaryExprAST->RHS))
+			return 0;
+		return -1;
+	}
+	
+	bool Code_Gen::scanTailCalls(ExprId body)
+	{
+		bool found = false;
+		std::vector<ExprId> pending(1, body);
+		while (!pending.empty()) {
+			ExprId id = pending.back();
+			ExprAST* node = ast.get(id);
+			pending.pop_back();
+			switch (node->getType()) {
+				case exprTypeCall:
+					found |= isSelfCall(id);
+					break;
+				case exprTypeIf:
+					pending.push_back(static_cast<IfExprAST*>(node)->Else);
+					pending.push_back(static_cast<IfExprAST*>(node)->Then);
+					break;
+				case exprTypeVarExpr:
+					pending.push_back(static_cast<VarExprAST*>(node)->Body);
+					break;
+				case exprTypeBinaryExpr: {
+					BinaryExprAST* binary = static_cast<BinaryExprAST*>(node);
+					if (binary->op == ':')
+						pending.push_back(binary->RHS);
+					else if (tailAccumulate && (binary->op == '*' || binary->op == '+') && (!accumulatorOp || accumulatorOp == binary->op)) {
+						bool site = (isSelfCall(binary->RHS) && isSimple(binary->LHS)) || (isSelfCall(binary->LHS) && isSimple(binary->RHS));
+						if (site) {
+							accumulatorOp = binary->op;
+							found = true;
+						}
+					}
+					break;
+				}
+				default:
+					break;
+			}
+		}
+		return found;
+	}
+	
+	Value* Code_Gen::reuse(ExprId id)
+	{
+		if (!ast.get(id)->Pure)
+			return nullptr;
+		if (Builder.GetInsertBlock() != reusableBlock) {
+			reusable.clear();
+			reusableBlock = Builder.GetInsertBlock();
+			return nullptr;
+		}
+		auto found = reusable.find(id.index);
+		if (found == reusable.end())
+			return nullptr;
+		reusedValues++;
+		return found->second;
+	}
+	
+	void Code_Gen::remember(ExprId id, Value* V)
+	{
+		if (!V || !ast.get(id)->Pure)
+			return;
+		if (Builder.GetInsertBlock() != reusableBlock) {
+			reusable.clear();
+			reusableBlock = Builder.GetInsertBlock();
+		}
+		reusable[id.index] = V;
+	}
+	
+	Value* Code_Gen::codegen(ExprId exprId)
+	{
+		size_t base = frames.size();
+		frames.push_back(CodegenFrame(exprId));
+		Value* child = nullptr;
+		while (1) {
+			CodegenFrame &frame = frames.back();
+			CodegenStep next = dispatch(frame.node, frame, child);
+			if (next.child) {
+				child = reuse(next.child);
+				childReused = child != nullptr;
+				if (!child) {
+					frames.push_back(CodegenFrame(next.child));
+					frames.back().tail = next.tail;
+					frames.back().condition = next.condition;
+				}
+				else if (!next.condition)
+					child = asDouble(child);
+				continue;
+			}
+			remember(frame.node, next.value);
+			childReused = false;
+			bool condition = frame.condition;
+			frames.pop_back();
+			child = condition ? next.value : asDouble(next.value);
+			if (frames.size() == base)
+				return child;
+		}
+	}
+	
+	Value* Code_Gen::asDouble(Value* V)
+	{
+		if (!V || !V->getType()->isIntegerTy(1))
+			return V;
+		return Builder.CreateUIToFP(V, Type::getDoubleTy(TheContext));
+	}
+	
+	Value* Code_Gen::toCondition(Value* V, const char* name)
+	{
+		if (V->getType()->isIntegerTy(1))
+			return V;
+		return Builder.CreateFCmpONE(V, ConstantFP::get(TheContext, APFloat(0.0)), name);
+	}
+	
+	CodegenStep Code_Gen::visitInvalid(ExprAST* exprAST, CodegenFrame &/*frame*/, Value* /*child*/)
+	{
+		KTRACE(traceCodegen, traceError, "Uknown expression type", "type", (int)exprAST->getType());
+		return finish(nullptr);
+	}
+	
+	uint64_t Code_Gen::jitFunction(const std::string &name)
+	{
+		InitializeNativeTarget();
+		InitializeNativeTargetAsmPrinter();
 		
+		std::string Error;
+		SmallVector<std::string, 1> Features;
+		if (!targetFeatures.empty())
+			Features.push_back(targetFeatures);
+		engine.reset(EngineBuilder(std::move(TheModule)).setErrorStr(&Error).setEngineKind(EngineKind::JIT)
+					 .setOptLevel(codegenOptLevel()).setMCPU(targetCPU).setMAttrs(Features).create());
+		if (!engine) {
+			errs() << "Could not create the JIT: " << Error << "\n";
+			return 0;
+		}
+		engine->finalizeObject();
+		return engine->getFunctionAddress(name);
 	}
 	
-	void Code_Gen::CodegenLog(std::string str) 
+	CodeGenOpt::Level Code_Gen::codegenOptLevel() const
 	{
-		if (printLog) 
+		switch (optLevel)
 		{
-			std::cout << "Codegen " << str << std::endl;
+			case 0: return CodeGenOpt::None;
+			case 1: return CodeGenOpt::Less;
+			case 3: return CodeGenOpt::Aggressive;
+			default: return CodeGenOpt::Default;
 		}
 	}
 	
-	int Code_Gen::WriteObjectFile()
+	void Code_Gen::setTarget(const std::string &cpu, const std::string &features)
+	{
+		targetCPU = cpu;
+		targetFeatures.clear();
+		if (cpu == "native") {
+			targetCPU = sys::getHostCPUName().str();
+			StringMap<bool> HostFeatures;
+			if (sys::getHostCPUFeatures(HostFeatures))
+				for (auto &Feature : HostFeatures)
+					targetFeatures += std::string(targetFeatures.empty() ? "" : ",") + (Feature.second ? "+" : "-") + Feature.first().str();
+		}
+		//explicit features come last, so they win over the host's
+		if (!features.empty())
+			targetFeatures += (targetFeatures.empty() ? "" : ",") + features;
+		KTRACE(traceCodegen, traceInfo, "target", "cpu", targetCPU, "features", targetFeatures);
+	}
+	
+	void Code_Gen::addTargetAttributes(Function* F)
+	{
+		if (!targetCPU.empty())
+			F->addFnAttr("target-cpu", targetCPU);
+		if (!targetFeatures.empty())
+			F->addFnAttr("target-features", targetFeatures);
+	}
+	
+	void Code_Gen::setFloatMode(PrototypeAST* protoExprAST)
 	{
+		unsigned flags = fpFlags;
+		functionContract = fpContract;
+		if (protoExprAST->Float == floatFast) {
+			flags = fpAllFlags;
+			functionContract = fpContractFast;
+		}
+		else if (protoExprAST->Float == floatStrict) {
+			flags = 0;
+			functionContract = fpContractOff;
+		}
+		
+		FastMathFlags FMF;
+		FMF.setNoNaNs(flags & fpNoNaNs);
+		FMF.setNoInfs(flags & fpNoInfs);
+		FMF.setNoSignedZeros(flags & fpNoSignedZeros);
+		FMF.setAllowReassoc(flags & fpReassoc);
+		FMF.setAllowReciprocal(flags & fpReciprocal);
+		FMF.setApproxFunc(flags & fpApproxFunc);
+		FMF.setAllowContract(functionContract == fpContractFast);
+		//every flag, which is what FastMathFlags::isFast() asks for
+		if (flags == fpAllFlags && functionContract == fpContractFast)
+			FMF.setFast();
+		Builder.setFastMathFlags(FMF);
+	}
+	
+	void Code_Gen::addFloatAttributes(Function* F)
+	{
+		FastMathFlags FMF = Builder.getFastMathFlags();
+		if (FMF.noNaNs())
+			F->addFnAttr("no-nans-fp-math", "true");
+		if (FMF.noInfs())
+			F->addFnAttr("no-infs-fp-math", "true");
+		if (FMF.noSignedZeros())
+			F->addFnAttr("no-signed-zeros-fp-math", "true");
+		if (FMF.approxFunc())
+			F->addFnAttr("approx-func-fp-math", "true");
+		if (FMF.isFast())
+			F->addFnAttr("unsafe-fp-math", "true");
+	}
+	
+	Value* Code_Gen::fuseMulAdd(BinaryExprAST* binaryExprAST, CodegenFrame &frame, Value* L, Value* R)
+	{
+		//operand 'i' is a '*' of this expression, generated by this frame rather than reused. Its
+		//multiply may still be bound or cached elsewhere, so it is left for DCE, never erased.
+		auto product = [&](unsigned i) -> BinaryOperator* {
+			BinaryExprAST* operand = ast.asOrNull<BinaryExprAST>(i ? binaryExprAST->RHS : binaryExprAST->LHS);
+			BinaryOperator* Mul = dyn_cast<BinaryOperator>(i ? R : L);
+			if (!frame.generated[i] || !operand || operand->op != '*' || !Mul || Mul->getOpcode() != Instruction::FMul)
+				return nullptr;
+			return Mul;
+		};
+		
+		//a * b + c, a * b - c = fmuladd(a, b, -c), c + a * b, c - a * b = fmuladd(-a, b, c)
+		BinaryOperator* Mul = product(0);
+		Value* Addend = R;
+		bool negateProduct = false;
+		if (!Mul) {
+			Mul = product(1);
+			Addend = L;
+			negateProduct = binaryExprAST->op == '-';
+		}
+		else if (binaryExprAST->op == '-')
+			Addend = Builder.CreateFNeg(Addend, "negtmp");
+		if (!Mul)
+			return nullptr;
+		Value* A = Mul->getOperand(0);
+		if (negateProduct)
+			A = Builder.CreateFNeg(A, "negtmp");
+		
+		Value* Fused = Builder.CreateIntrinsic(Intrinsic::fmuladd, {Type::getDoubleTy(TheContext)}, {A, Mul->getOperand(1), Addend},
+											   nullptr, "fmatmp");
+		mulAddsFused++;
+		return Fused;
+	}
+	
+	TargetMachine* Code_Gen::getTargetMachine()
+	{
+		if (targetMachine)
+			return targetMachine.get();
+		
 		// Initialize the target registry etc.
 		InitializeAllTargetInfos();
 		InitializeAllTargets();
@@ -464,7 +1364,6 @@ namespace myCompiler{
 		InitializeAllAsmPrinters();
 		
 		auto TargetTriple = sys::getDefaultTargetTriple();
-		TheModule->setTargetTriple(TargetTriple);
 		
 		std::string Error;
 		auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
@@ -474,17 +1373,227 @@ namespace myCompiler{
 		// TargetRegistry or we have a bogus target triple.
 		if (!Target) {
 			errs() << Error;
-			return 1;
+			return nullptr;
 		}
 		
-		auto CPU = "generic";
-		auto Features = "";
+		std::string CPU = targetCPU.empty() ? "generic" : targetCPU;
+		std::string Features = targetFeatures;
 		
 		TargetOptions opt;
 		auto RM = Optional<Reloc::Model>();
-		auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+		targetMachine.reset(Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM, None, codegenOptLevel()));
+		return targetMachine.get();
+	}
+	
+	void Code_Gen::optimize()
+	{
+		if (optLevel == 0 && !optSize)
+			return;
+		TargetMachine* TheTargetMachine = getTargetMachine();
+		if (TheTargetMachine) {
+			TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+			TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+		}
+		
+		size_t before = 0;
+		for (Function &F : *TheModule)
+			before += F.getInstructionCount();
+		
+		LoopAnalysisManager LAM;
+		FunctionAnalysisManager FAM;
+		CGSCCAnalysisManager CGAM;
+		ModuleAnalysisManager MAM;
+		PassBuilder PB(TheTargetMachine);
+		PB.registerModuleAnalyses(MAM);
+		PB.registerCGSCCAnalyses(CGAM);
+		PB.registerFunctionAnalyses(FAM);
+		PB.registerLoopAnalyses(LAM);
+		PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+		
+		OptimizationLevel Level = optSize ? OptimizationLevel::Os :
+								  optLevel == 1 ? OptimizationLevel::O1 :
+								  optLevel == 2 ? OptimizationLevel::O2 : OptimizationLevel::O3;
+		ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+		MPM.run(*TheModule, MAM);
+		
+		size_t after = 0;
+		for (Function &F : *TheModule)
+			after += F.getInstructionCount();
+		KTRACE(tracePass, traceInfo, "optimize", "level", optSize ? "s" : std::to_string(optLevel), "instructions before", before,
+			   "instructions after", after);
+		if (stats::enabled()) {
+			stats::add("opt.instructions-before", before);
+			stats::add("opt.instructions-after", after);
+		}
+	}
+	
+	const char* const Code_Gen::IsaLevelNames[Code_Gen::IsaLevels] = {"x86-64", "x86-64-v2", "x86-64-v3", "x86-64-v4"};
+	
+	Value* Code_Gen::emitIsaLevel(Function* F)
+	{
+		Type* Int32 = Type::getInt32Ty(TheContext);
+		StructType* Regs = StructType::get(TheContext, {Int32, Int32, Int32, Int32});
+		InlineAsm* Cpuid = InlineAsm::get(FunctionType::get(Regs, {Int32, Int32}, false), "cpuid",
+										  "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}", false);
+		auto cpuid = [&](uint32_t leaf) {
+			return Builder.CreateCall(Cpuid, {ConstantInt::get(Int32, leaf), ConstantInt::get(Int32, 0)}, "cpuid");
+		};
+		//all of 'bits' set in 'reg'
+		auto has = [&](Value* reg, uint32_t bits) {
+			return Builder.CreateICmpEQ(Builder.CreateAnd(reg, bits), ConstantInt::get(Int32, bits));
+		};
+		
+		//leaves 7 and 0x80000001 read as 0 when the CPU does not have them
+		Value* MaxLeaf = Builder.CreateExtractValue(cpuid(0), 0);
+		Value* MaxExtLeaf = Builder.CreateExtractValue(cpuid(0x80000000), 0);
+		Value* Ecx1 = Builder.CreateExtractValue(cpuid(1), 2);
+		Value* Ebx7 = Builder.CreateSelect(Builder.CreateICmpUGE(MaxLeaf, ConstantInt::get(Int32, 7)),
+										   Builder.CreateExtractValue(cpuid(7), 1), ConstantInt::get(Int32, 0));
+		Value* EcxExt = Builder.CreateSelect(Builder.CreateICmpUGE(MaxExtLeaf, ConstantInt::get(Int32, 0x80000001)),
+											 Builder.CreateExtractValue(cpuid(0x80000001), 2), ConstantInt::get(Int32, 0));
+		
+		//xgetbv faults unless the OS has enabled it (OSXSAVE)
+		BasicBlock* CheckBB = Builder.GetInsertBlock();
+		BasicBlock* XgetbvBB = BasicBlock::Create(TheContext, "xgetbv", F);
+		BasicBlock* LevelBB = BasicBlock::Create(TheContext, "level", F);
+		Builder.CreateCondBr(has(Ecx1, 1u << 27), XgetbvBB, LevelBB);
+		Builder.SetInsertPoint(XgetbvBB);
+		InlineAsm* Xgetbv = InlineAsm::get(FunctionType::get(StructType::get(TheContext, {Int32, Int32}), {Int32}, false), "xgetbv",
+										   "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}", false);
+		Value* Xcr0Low = Builder.CreateExtractValue(Builder.CreateCall(Xgetbv, {ConstantInt::get(Int32, 0)}, "xgetbv"), 0);
+		Builder.CreateBr(LevelBB);
+		Builder.SetInsertPoint(LevelBB);
+		PHINode* Xcr0 = Builder.CreatePHI(Int32, 2, "xcr0");
+		Xcr0->addIncoming(ConstantInt::get(Int32, 0), CheckBB);
+		Xcr0->addIncoming(Xcr0Low, XgetbvBB);
+		
+		//v2: SSE3, SSSE3, CMPXCHG16B, SSE4.1, SSE4.2, POPCNT, LAHF
+		Value* V2 = Builder.CreateAnd(has(Ecx1, 1u << 0 | 1u << 9 | 1u << 13 | 1u << 19 | 1u << 20 | 1u << 23), has(EcxExt, 1u << 0));
+		//v3: AVX, FMA, MOVBE, F16C, BMI1, BMI2, AVX2, LZCNT, and the OS saving the YMM state
+		Value* V3 = Builder.CreateAnd(V2, has(Ecx1, 1u << 12 | 1u << 22 | 1u << 28 | 1u << 29));
+		V3 = Builder.CreateAnd(V3, has(Ebx7, 1u << 3 | 1u << 5 | 1u << 8));
+		V3 = Builder.CreateAnd(V3, has(EcxExt, 1u << 5));
+		V3 = Builder.CreateAnd(V3, has(Xcr0, 0x6));
+		//v4: AVX512F, DQ, CD, BW, VL, and the OS saving the opmask and ZMM state
+		Value* V4 = Builder.CreateAnd(V3, has(Ebx7, 1u << 16 | 1u << 17 | 1u << 28 | 1u << 30 | 1u << 31));
+		V4 = Builder.CreateAnd(V4, has(Xcr0, 0xE6));
+		
+		Value* Level = Builder.CreateZExt(V2, Int32);
+		Level = Builder.CreateAdd(Level, Builder.CreateZExt(V3, Int32));
+		return Builder.CreateAdd(Level, Builder.CreateZExt(V4, Int32), "isalevel");
+	}
+	
+	bool Code_Gen::multiversion()
+	{
+		TargetMachine* TheTargetMachine = getTargetMachine();
+		if (!TheTargetMachine || TheTargetMachine->getTargetTriple().getArch() != Triple::x86_64) {
+			KTRACE(traceCodegen, traceError, "--multiversion needs an x86-64 target");
+			return false;
+		}
+		
+		std::vector<Function*> versioned;
+		for (Function &F : *TheModule)
+			if (!F.isDeclaration())
+				versioned.push_back(&F);
+		
+		//clones[level][i] is the clone of versioned[i] for that level
+		std::vector<std::vector<Function*>> clones(IsaLevels);
+		std::unordered_map<Function*, size_t> index;
+		for (size_t i = 0; i < versioned.size(); i++)
+			index[versioned[i]] = i;
+		for (unsigned level = 0; level < IsaLevels; level++) {
+			for (Function* F : versioned) {
+				ValueToValueMapTy VMap;
+				Function* Clone = CloneFunction(F, VMap);
+				Clone->setName(F->getName() + "." + IsaLevelNames[level]);
+				Clone->setLinkage(Function::InternalLinkage);
+				Clone->removeFnAttr("target-features");
+				Clone->addFnAttr("target-cpu", IsaLevelNames[level]);
+				clones[level].push_back(Clone);
+			}
+			//calls stay within the level
+			for (Function* Clone : clones[level])
+				for (BasicBlock &BB : *Clone)
+					for (Instruction &I : BB)
+						if (CallInst* Call = dyn_cast<CallInst>(&I)) {
+							auto callee = index.find(Call->getCalledFunction());
+							if (callee != index.end())
+								Call->setCalledFunction(clones[level][callee->second]);
+						}
+		}
+		
+		//each exported function calls through a pointer to a clone, the baseline one until the
+		//constructor has run
+		Function* Select = Function::Create(FunctionType::get(Type::getVoidTy(TheContext), false), Function::InternalLinkage,
+											"multiversion.select", TheModule.get());
+		std::vector<std::pair<GlobalVariable*, size_t>> pointers;
+		std::vector<Function*> internal;
+		for (size_t i = 0; i < versioned.size(); i++) {
+			Function* F = versioned[i];
+			if (F->hasLocalLinkage()) {
+				//only called by other originals (a memo wrapper's '.body', a '.specN'); erased once
+				//none of them has a body left
+				internal.push_back(F);
+				continue;
+			}
+			if (!F->hasName()) {
+				//an anonymous expression: keep it, running the baseline clone
+				F->deleteBody();
+				BasicBlock* BB = BasicBlock::Create(TheContext, "entry", F);
+				Builder.SetInsertPoint(BB);
+				Builder.CreateRet(Builder.CreateCall(clones[0][i], {}));
+				continue;
+			}
+			GlobalVariable* Pointer = new GlobalVariable(*TheModule, F->getType(), false, GlobalValue::InternalLinkage, clones[0][i],
+														 F->getName() + ".impl");
+			pointers.emplace_back(Pointer, i);
+			
+			F->deleteBody();
+			BasicBlock* BB = BasicBlock::Create(TheContext, "entry", F);
+			Builder.SetInsertPoint(BB);
+			std::vector<Value*> Args;
+			for (Argument &Arg : F->args())
+				Args.push_back(&Arg);
+			Value* Impl = Builder.CreateLoad(F->getType(), Pointer, "impl");
+			CallInst* Call = Builder.CreateCall(F->getFunctionType(), Impl, Args);
+			Call->setTailCallKind(CallInst::TCK_MustTail);
+			Builder.CreateRet(Call);
+			functionsMultiversioned++;
+		}
+		//internal originals may still call each other
+		for (Function* F : internal)
+			F->dropAllReferences();
+		for (Function* F : internal) {
+			assert(F->use_empty() && "multiversioned original still referenced");
+			F->eraseFromParent();
+		}
+		
+		BasicBlock* BB = BasicBlock::Create(TheContext, "entry", Select);
+		Builder.SetInsertPoint(BB);
+		Value* Level = forceIsaLevel >= 0 ? ConstantInt::get(Type::getInt32Ty(TheContext), forceIsaLevel) : emitIsaLevel(Select);
+		for (auto &pointer : pointers) {
+			Value* Best = clones[0][pointer.second];
+			for (unsigned level = 1; level < IsaLevels; level++)
+				Best = Builder.CreateSelect(Builder.CreateICmpUGE(Level, ConstantInt::get(Level->getType(), level)),
+											clones[level][pointer.second], Best);
+			Builder.CreateStore(Best, pointer.first);
+		}
+		Builder.CreateRetVoid();
+		appendToGlobalCtors(*TheModule, Select, 0);
+		
+		stats::add("multiversion.functions", versioned.size());
+		stats::add("multiversion.dispatched", functionsMultiversioned);
+		KTRACE(traceCodegen, traceInfo, "multiversion", "functions", versioned.size(), "exported", functionsMultiversioned);
+		return true;
+	}
+	
+	int Code_Gen::WriteObjectFile()
+	{
+		auto TheTargetMachine = getTargetMachine();
+		if (!TheTargetMachine)
+			return 1;
 		TheModule->setDataLayout(TheTargetMachine->createDataLayout());
-		TheModule->setTargetTriple(TargetTriple);
+		TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
 		
 		auto Filename = "output.o";
 		std::error_code EC;
@@ -496,7 +1605,7 @@ namespace myCompiler{
 		}
 		
 		legacy::PassManager pass;
-		auto FileType = llvm::LLVMTargetMachine::CGFT_ObjectFile;
+		auto FileType = llvm::CGFT_ObjectFile;
 
 		if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
 		  errs() << "TargetMachine can't emit a file of this type";
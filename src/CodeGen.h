@@ -1,20 +1,27 @@
 
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
-#include "llvm/Support/TargetRegistry.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 
 #include <algorithm>
@@ -28,6 +35,15 @@
 #include <fstream>
 #include <utility>
 #include <iostream>
+#include <unordered_map>
+
+#include "Interner.h"
+#include "SymbolTable.h"
+#include "Trace.h"
+#include "ASTVisitor.h"
+#include "IntInference.h"
+#include "Operators.h"
+#include "Options.h"
 
 using namespace std;
 using namespace llvm;
@@ -35,17 +51,70 @@ using namespace llvm;
 static llvm::LLVMContext TheContext;
 static llvm::IRBuilder<> Builder(TheContext);
 static std::unique_ptr<llvm::Module> TheModule;
-static std::map<string, AllocaInst*> NamedValues;
 
 
 namespace myCompiler{
 	
 
-class Code_Gen {
+//Progress of one node whose code is being generated. Code_Gen::codegen keeps these on an explicit
+//stack instead of recursing, so expression depth is limited by heap memory only.
+struct CodegenFrame {
+	ExprId node;
+	//how far the node's visit() has got, 0 on entry
+	uint32_t step = 0;
+	//next entry of the node's list (call arguments, var bindings)
+	uint32_t index = 0;
+	//operands and blocks kept between steps
+	Value* values[2] = {nullptr, nullptr};
+	BasicBlock* blocks[3] = {nullptr, nullptr, nullptr};
+	AllocaInst* alloca = nullptr;
+	//the node's value is the function's result (see Code_Gen's tail calls)
+	bool tail = false;
+	//the parent only tests the value, so a comparison may finish with its i1
+	bool condition = false;
+	//operands generated by this frame, rather than reused values of shared nodes (see fuseMulAdd)
+	bool generated[2] = {false, false};
+
+	CodegenFrame(ExprId _node) : node(_node) {}
+};
+
+//What a visit() step asks for next: the value of another node (which then resumes this one with
+//the child's value), or this node is finished with 'value'
+struct CodegenStep {
+	ExprId child;
+	Value* value;
+	//child is in tail position
+	bool tail = false;
+	//child is only tested for truth
+	bool condition = false;
+};
+
+//Emits IR for one node at a time; see ASTVisitor for how nodes are dispatched
+class Code_Gen : public ASTVisitor<Code_Gen, CodegenStep> {
 	public:
-	bool printLog;
+	//spellings of the SymbolIds held by the AST
+	StringInterner &symbols;
+
+	//functions implementing user-defined operators
+	OperatorTable &operators;
+
+	//variables in scope, restored when a 'var' or 'for' scope ends: the stack slot of a variable that
+	//is assigned with '=', the SSA value (double or i64) of one that is not
+	ScopedSymbolTable<Value*> NamedValues;
+
+	//functions declared so far, indexed by SymbolId
+	std::vector<Function*> FunctionsById;
 	
-	Code_Gen(bool _printLog);
+	Code_Gen(StringInterner &_symbols, ASTContext &_ast, OperatorTable &_operators);
+
+	Function* getFunction(SymbolId name);
+
+	void setFunction(SymbolId name, Function* F);
+
+	//moves F after every other function of the module
+	void moveToEnd(Function* F);
+
+	std::string getName(SymbolId name) { return std::string(symbols.str(name)); }
 
 	
 	template <typename T, typename ...Args> std::unique_ptr<T> make_unique(Args&& ...args)
@@ -53,41 +122,243 @@ class Code_Gen {
 		return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 	}
 	
-	AllocaInst *CreateEntryblockAlloca(Function *TheFunction, std::string varName);
+	//a double slot unless 'type' is given
+	AllocaInst *CreateEntryblockAlloca(Function *TheFunction, std::string varName, Type* type = nullptr);
+
+	//Variables IntegerInference proves integral live in i64 slots; reading one converts it to double
+	IntegerInference integers;
+	bool inferIntegers = true;
+
+	bool isIntegerSlot(AllocaInst* V) const { return V->getAllocatedType()->isIntegerTy(); }
+
+	//i64 slot, or i64 SSA value
+	bool isIntegerVariable(Value* V) const;
+
+	//literal integer, or integer variable
+	bool isIntegerOperand(ExprId id);
+
+	Value* integerOperand(ExprId id);
+
+	//Only variables assigned with '=' somewhere in the function get a stack slot. Arguments and
+	//'var's that never are bound to their value, the induction variable of a loop to a phi in the
+	//loop header, and the arguments of a function that loops through self tail calls to phis in
+	//'tailrecurse'. Assignments are found by name, so a name assigned in one scope also gives a slot
+	//to the other variables of that name in the function.
+	bool directSSA = true;
+	std::vector<bool> assignedNames;
+	size_t ssaVariables = 0;
+
+	void scanAssignments(ExprId body);
+
+	bool isAssigned(SymbolId name) const { return !directSSA || (name < assignedNames.size() && assignedNames[name]); }
 	
 	
-	Value* codegen(NumberExprAST* numExprAST);
+	//frames of the nodes being generated, innermost last
+	std::vector<CodegenFrame> frames;
+	//call arguments generated so far, for every call in progress
+	std::vector<Value*> argValues;
+
+	//Values of Pure nodes emitted in 'reusableBlock', by node index. A shared node met again in the
+	//same block reuses its value instead of being emitted twice. Loads are only valid until the next
+	//store or scope change, so those empty the cache (forgetValues).
+	std::unordered_map<uint32_t, Value*> reusable;
+	BasicBlock* reusableBlock = nullptr;
+	size_t reusedValues = 0;
+	//the child value the current frame was just given came from 'reusable'
+	bool childReused = false;
+
+	Value* reuse(ExprId id);
+
+	void remember(ExprId id, Value* V);
+
+	void forgetValues() { reusable.clear(); }
+
+	//--auto-memoize: the definition of a function marked with setMemoized() goes into an internal
+	//'<name>.body' function, and '<name>' becomes a wrapper that looks the arguments up in a table of
+	//memoEntries results before calling the body. The table is direct-mapped on a hash of the argument
+	//bit patterns, and a new result evicts whatever was in its slot.
+	static const unsigned MaxMemoArgs = 4;
+	uint32_t memoEntries = 4096;
+	std::vector<bool> memoized;
+	//body function behind each wrapper
+	std::unordered_map<Function*, Function*> memoBodies;
+
+	//memoize the next definition of 'name', if it takes 1 to MaxMemoArgs arguments
+	void setMemoized(SymbolId name);
+
+	bool isMemoized(SymbolId name) const { return name < memoized.size() && memoized[name]; }
+
+	void emitMemoWrapper(Function* F, Function* Body);
+
+	//Tail calls. A function's body is in tail position, and so are the branches of an 'if', the right
+	//side of ':' and the body of a 'var' in tail position. Calls there are marked 'tail'. A call of the
+	//function itself there stores the arguments to the parameters and branches back to 'tailrecurse',
+	//just after the parameters are stored on entry, so self recursion in tail position runs in
+	//constant stack.
+	//
+	//--tail-accumulate also handles 'x * f(...)' and 'f(...) + x' in tail position, where x has no
+	//calls or assignments: x is folded into an accumulator before the branch back, and the result of
+	//the function is combined with the accumulator on return. This reassociates the floating point
+	//arithmetic, so it is opt-in. A function uses one accumulator operator, the first one found.
+	bool tailAccumulate = false;
+	//state for the function being generated; tailHeader is null when it has no self call in tail
+	//position
+	SymbolId tailSelf = 0;
+	Function* tailFunction = nullptr;
+	BasicBlock* tailHeader = nullptr;
+	//slot or phi of each parameter
+	std::vector<Value*> tailParams;
+	AllocaInst* accumulator = nullptr;
+	OperatorId accumulatorOp = 0;
+	size_t tailCallsMarked = 0;
+	size_t tailCallsLooped = 0;
+	size_t accumulatorSites = 0;
+
+	//looks for self calls and accumulator sites in the tail positions of a body, setting accumulatorOp
+	bool scanTailCalls(ExprId body);
+
+	bool isSelfCall(ExprId id) const;
+
+	//no calls or assignments in the expression
+	bool isSimple(ExprId id) const;
+
+	//no calls, user-defined operators or loops other than integral ones in the expression
+	bool alwaysTerminates(ExprId id) const;
+
+	//0 or 1 for the operand of an accumulator site that is the self call, -1 if it is not a site
+	int accumulatorOperand(BinaryExprAST* binaryExprAST) const;
+
+	//If-conversion: an 'if' whose arms have no calls or assignments can compute both arms and select
+	//one, with no branch to mispredict. --select-if=auto does so when the arms together cost at most
+	//SelectCostLimit operations ('/' counts as 4, other builtin operators as 1, numbers and variables
+	//as 0), always ignores the cost, never keeps the branches.
+	SelectIfMode selectIf = selectIfAuto;
+	static const unsigned SelectCostLimit = 8;
+	size_t selectsEmitted = 0;
+
+	//operations an expression without calls or assignments costs, NotSelectable for any other
+	static const unsigned NotSelectable = ~0u;
+	unsigned armCost(ExprId id) const;
+
+	bool useSelect(IfExprAST* ifExprAST) const;
+
+	//-O0 to -O3 and -Os: optimize() runs the PassBuilder pipeline of that level on the whole module,
+	//and the target machine generates code at the matching CodeGenOpt level. -O0 runs nothing.
+	unsigned optLevel = 0;
+	bool optSize = false;
+
+	CodeGenOpt::Level codegenOptLevel() const;
+
+	void optimize();
+
+	//--mcpu and --mattr, with "native" already replaced by the host's CPU and features. Empty means
+	//the generic CPU and no extra features, and leaves functions without target attributes.
+	std::string targetCPU;
+	std::string targetFeatures;
+
+	//cpu "native" (or empty) and a comma separated feature list, as given on the command line
+	void setTarget(const std::string &cpu, const std::string &features);
+
+	//target-cpu / target-features attributes, so the optimizer sees the same target as codegen
+	void addTargetAttributes(Function* F);
+
+	//--fp-flags and --fp-contract, for functions defined without 'def fast' or 'def strict'.
+	//setFloatMode puts a function's fast-math flags on Builder at its entry, so every floating point
+	//instruction emitted for it carries them; addFloatAttributes repeats them as the function
+	//attributes the backend reads.
+	unsigned fpFlags = 0;
+	FPContractMode fpContract = fpContractOff;
+	//contraction of the function being generated
+	FPContractMode functionContract = fpContractOff;
+	size_t mulAddsFused = 0;
+
+	void setFloatMode(PrototypeAST* protoExprAST);
+
+	void addFloatAttributes(Function* F);
+
+	//--fp-contract=on: a '+' or '-' with a '*' operand the frame generated itself becomes
+	//llvm.fmuladd; null when neither operand is one
+	Value* fuseMulAdd(BinaryExprAST* binaryExprAST, CodegenFrame &frame, Value* L, Value* R);
+
+	//--multiversion: every defined function is cloned once per x86-64 ISA level (baseline, v2, v3,
+	//v4), each clone with that level as its target-cpu and calling the clones of its own level. An
+	//exported function keeps its name and becomes a stub calling through a pointer, which a global
+	//constructor sets to the best clone for the CPU it runs on (cpuid, and xgetbv for the AVX state
+	//the OS saves). Internal functions are only reached from clones and are replaced by theirs.
+	//Returns false if the target is not x86-64.
+	static const unsigned IsaLevels = 4;
+	static const char* const IsaLevelNames[IsaLevels];
+	//level the constructor picks instead of detecting it, for testing each clone; -1 detects
+	int forceIsaLevel = -1;
+	size_t functionsMultiversioned = 0;
+
+	bool multiversion();
+
+	//0 to 3 for the best level the CPU supports
+	Value* emitIsaLevel(Function* F);
+
+	//for the host triple, created on first use; null if the target is not available
+	std::unique_ptr<TargetMachine> targetMachine;
+	TargetMachine* getTargetMachine();
+
+	//--bench-select: compiles the module in memory and returns the address of function 'name', 0 if
+	//it cannot. The engine takes the module over.
+	std::unique_ptr<ExecutionEngine> engine;
+	uint64_t jitFunction(const std::string &name);
+
+	static CodegenStep descend(ExprId child) { return {child, nullptr}; }
+	static CodegenStep descendTail(ExprId child) { return {child, nullptr, true}; }
+	static CodegenStep descendCondition(ExprId child) { return {child, nullptr, false, true}; }
+	static CodegenStep finish(Value* value) { return {ExprId(), value}; }
+
+	//Comparisons, '&' and '|' finish with an i1. codegen() hands it as is to a parent that asked
+	//for a condition (the test of an 'if' or 'for', an operand of '&' or '|'), and converts it to
+	//0.0 / 1.0 for any other parent.
+	Value* asDouble(Value* V);
+
+	//i1 for the truth of a child asked for with descendCondition(): a double is compared with 0.0
+	Value* toCondition(Value* V, const char* name);
+
+	//Each visit() is called on entry to a node with child == nullptr, and again with the value of
+	//every child it asks for.
+	CodegenStep visit(NumberExprAST* numExprAST, CodegenFrame &frame, Value* child);
+	
 	
+	CodegenStep visit(VariableExprAST* variableExprAST, CodegenFrame &frame, Value* child);
 	
-	Value*  codegen(VariableExprAST* variableExprAST);
 	
+	CodegenStep visit(BinaryExprAST* binaryExprAST, CodegenFrame &frame, Value* child);
 	
-	Value*  codegen(BinaryExprAST* binaryExprAST);
 	
+	CodegenStep visit(UnaryExprAST* unaryExprAST, CodegenFrame &frame, Value* child);
 	
-	Value*  codegen(CallExprAST* callExprAST);
 	
+	CodegenStep visit(CallExprAST* callExprAST, CodegenFrame &frame, Value* child);
 	
-	Function*  codegen(PrototypeAST* protoExprAST);
+	
+	CodegenStep visit(PrototypeAST* protoExprAST, CodegenFrame &frame, Value* child);
 
 	
-	Function*  codegen(FunctionAST* fnExprAST);
+	CodegenStep visit(FunctionAST* fnExprAST, CodegenFrame &frame, Value* child);
 	
 
-	Value*  codegen(IfExprAST* ifExprAST);
+	CodegenStep visit(IfExprAST* ifExprAST, CodegenFrame &frame, Value* child);
 
 	
 	
-	Value*  codegen(ForExprAST* forExprAST);
+	CodegenStep visit(ForExprAST* forExprAST, CodegenFrame &frame, Value* child);
 
 	
-	Value*  codegen(VarExprAST* varExprAST);
+	CodegenStep visit(VarExprAST* varExprAST, CodegenFrame &frame, Value* child);
 
 	
-	Value* codegen(std::shared_ptr<ExprAST> exprAST);
+	CodegenStep visitInvalid(ExprAST* exprAST, CodegenFrame &frame, Value* child);
 
-	
-	void CodegenLog(std::string str);
+	//declaration of a prototype's function
+	Function* declare(PrototypeAST* protoExprAST);
+
+	//IR for any node
+	Value* codegen(ExprId exprId);
 
 	
 	void WriteIRFile(std::string irFile);
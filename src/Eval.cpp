@@ -0,0 +1,280 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "Eval.h"
+
+namespace myCompiler {
+
+	double* Evaluator::lookup(SymbolId name)
+	{
+		for (size_t i = env.size(); i > callBase; i--)
+			if (env[i - 1].first == name)
+				return &env[i - 1].second;
+		return nullptr;
+	}
+
+	EvalStep Evaluator::enterCall(EvalFrame &frame, SymbolId fn, uint32_t argBase)
+	{
+		ExprId body = fn < pureFunctions.size() ? pureFunctions[fn] : ExprId();
+		if (!body) {
+			argStack.resize(argBase);
+			return fail();
+		}
+		FunctionAST* F = ast.as<FunctionAST>(body);
+		auto params = ast.symbolList(ast.as<PrototypeAST>(F->Proto)->Args);
+		if (params.size() != argStack.size() - argBase) {
+			argStack.resize(argBase);
+			return fail();
+		}
+
+		frame.envSize = env.size();
+		frame.callBase = callBase;
+		callBase = env.size();
+		for (uint32_t i = 0; i < params.size(); i++)
+			env.emplace_back(params[i], argStack[argBase + i]);
+		argStack.resize(argBase);
+		return descend(F->Body);
+	}
+
+	double Evaluator::leaveCall(EvalFrame &frame, double result)
+	{
+		env.resize(frame.envSize);
+		callBase = frame.callBase;
+		return result;
+	}
+
+	bool Evaluator::evaluate(ExprId expr, double &result)
+	{
+		frames.clear();
+		argStack.clear();
+		env.clear();
+		callBase = 0;
+
+		uint64_t budget = stepLimit;
+		frames.push_back(EvalFrame(expr));
+		double child = 0.0;
+		while (1) {
+			if (!budget--)
+				return false;
+			steps++;
+			EvalFrame &frame = frames.back();
+			EvalStep next = dispatch(frame.node, frame, child);
+			if (next.kind == EvalStep::evalFail)
+				return false;
+			if (next.kind == EvalStep::evalDescend) {
+				frames.push_back(EvalFrame(next.child));
+				child = 0.0;
+				continue;
+			}
+			frames.pop_back();
+			child = next.value;
+			if (frames.empty()) {
+				result = child;
+				return true;
+			}
+		}
+	}
+
+	EvalStep Evaluator::visit(NumberExprAST* numExprAST, EvalFrame &/*frame*/, double /*child*/)
+	{
+		return finish(numExprAST->Val);
+	}
+
+	EvalStep Evaluator::visit(VariableExprAST* variableExprAST, EvalFrame &/*frame*/, double /*child*/)
+	{
+		double* V = lookup(variableExprAST->Name);
+		return V ? finish(*V) : fail();
+	}
+
+	EvalStep Evaluator::visit(BinaryExprAST* binaryExprAST, EvalFrame &frame, double child)
+	{
+		uint8_t op = binaryExprAST->op;
+		if (op == '=') {
+			VariableExprAST* LHSE = ast.asOrNull<VariableExprAST>(binaryExprAST->LHS);
+			if (frame.step == 0) {
+				if (!LHSE)
+					return fail();
+				frame.step = 1;
+				return descend(binaryExprAST->RHS);
+			}
+			double* V = lookup(LHSE->Name);
+			if (!V)
+				return fail();
+			*V = child;
+			return finish(child);
+		}
+
+		switch (frame.step)
+		{
+			case 0:
+				frame.step = 1;
+				return descend(binaryExprAST->LHS);
+			case 1:
+				//'&' and '|' only evaluate their right side when the left one does not decide
+				if ((op == '&' && !isTrue(child)) || (op == '|' && isTrue(child)))
+					return finish(op == '|' ? 1.0 : 0.0);
+				frame.value = child;
+				frame.step = 2;
+				return descend(binaryExprAST->RHS);
+			case 3:
+				//user-defined operator returned
+				return finish(leaveCall(frame, child));
+			default:
+				break;
+		}
+
+		double L = frame.value, R = child;
+		switch (op)
+		{
+			case '+': return finish(L + R);
+			case '-': return finish(L - R);
+			case '*': return finish(L * R);
+			case '/': return finish(L / R);
+			case '<': return finish(!(L >= R) ? 1.0 : 0.0);
+			case '>': return finish(!(L <= R) ? 1.0 : 0.0);
+			case '&':
+			case '|': return finish(isTrue(R) ? 1.0 : 0.0);
+			case ':': return finish(R);
+			default: break;
+		}
+
+		if (!operators.hasBinaryFunction(op))
+			return fail();
+		uint32_t argBase = argStack.size();
+		argStack.push_back(L);
+		argStack.push_back(R);
+		frame.step = 3;
+		return enterCall(frame, operators.binaryFunction(op), argBase);
+	}
+
+	EvalStep Evaluator::visit(UnaryExprAST* unaryExprAST, EvalFrame &frame, double child)
+	{
+		switch (frame.step)
+		{
+			case 0:
+				frame.step = 1;
+				return descend(unaryExprAST->Operand);
+			case 1:
+			{
+				if (!operators.hasUnaryFunction(unaryExprAST->op))
+					return fail();
+				uint32_t argBase = argStack.size();
+				argStack.push_back(child);
+				frame.step = 2;
+				return enterCall(frame, operators.unaryFunction(unaryExprAST->op), argBase);
+			}
+			default:
+				return finish(leaveCall(frame, child));
+		}
+	}
+
+	EvalStep Evaluator::visit(CallExprAST* callExprAST, EvalFrame &frame, double child)
+	{
+		auto Args = ast.exprList(callExprAST->Args);
+		switch (frame.step)
+		{
+			case 0:
+				frame.index = argStack.size();
+				frame.step = 1;
+				break;
+			case 1:
+				argStack.push_back(child);
+				break;
+			default:
+				return finish(leaveCall(frame, child));
+		}
+
+		size_t done = argStack.size() - frame.index;
+		if (done < Args.size())
+			return descend(Args[done]);
+		frame.step = 2;
+		return enterCall(frame, callExprAST->Callee, frame.index);
+	}
+
+	EvalStep Evaluator::visit(IfExprAST* ifExprAST, EvalFrame &frame, double child)
+	{
+		switch (frame.step)
+		{
+			case 0:
+				frame.step = 1;
+				return descend(ifExprAST->Cond);
+			case 1:
+				frame.step = 2;
+				return descend(isTrue(child) ? ifExprAST->Then : ifExprAST->Else);
+			default:
+				return finish(child);
+		}
+	}
+
+	EvalStep Evaluator::visit(ForExprAST* forExprAST, EvalFrame &frame, double child)
+	{
+		switch (frame.step)
+		{
+			case 0:
+				frame.step = 1;
+				return descend(forExprAST->Start);
+			case 1:
+				if (lookup(forExprAST->InductionVarName))
+					return fail();
+				frame.envSize = env.size();
+				env.emplace_back(forExprAST->InductionVarName, child);
+				frame.step = 4;
+				return descend(forExprAST->End);
+			case 2:
+				frame.step = 3;
+				return descend(forExprAST->Step);
+			case 3:
+				env[frame.envSize].second += child;
+				frame.step = 4;
+				return descend(forExprAST->End);
+			default:
+				break;
+		}
+
+		//the end condition is tested before the first iteration and after every step, like the
+		//generated loop
+		if (isTrue(child)) {
+			frame.step = 2;
+			return descend(forExprAST->Body);
+		}
+		env.resize(frame.envSize);
+		return finish(0.0);
+	}
+
+	EvalStep Evaluator::visit(VarExprAST* varExprAST, EvalFrame &frame, double child)
+	{
+		auto VarNames = ast.varBindingList(varExprAST->VarNames);
+		switch (frame.step)
+		{
+			case 0:
+				frame.envSize = env.size();
+				break;
+			case 1:
+				env.emplace_back(VarNames[frame.index].Name, child);
+				frame.index++;
+				break;
+			default:
+				env.resize(frame.envSize);
+				return finish(child);
+		}
+
+		for (; frame.index < VarNames.size(); frame.index++) {
+			if (lookup(VarNames[frame.index].Name))
+				return fail();
+			if (VarNames[frame.index].Init) {
+				frame.step = 1;
+				return descend(VarNames[frame.index].Init);
+			}
+			env.emplace_back(VarNames[frame.index].Name, 0.0);
+		}
+		frame.step = 2;
+		return descend(varExprAST->Body);
+	}
+
+}
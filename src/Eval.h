@@ -0,0 +1,110 @@
+#ifndef EVAL_DEFINED
+#define EVAL_DEFINED
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "ASTVisitor.h"
+#include "Operators.h"
+
+namespace myCompiler {
+
+//Progress of one node being evaluated, kept on an explicit stack like CodegenFrame
+struct EvalFrame {
+	ExprId node;
+	uint32_t step = 0;
+	//call: first of its arguments in argStack; var: next binding
+	uint32_t index = 0;
+	double value = 0.0;
+	//size of 'env' and the call boundary to restore when the node's scope or call ends
+	uint32_t envSize = 0;
+	uint32_t callBase = 0;
+
+	EvalFrame(ExprId _node) : node(_node) {}
+};
+
+struct EvalStep {
+	enum Kind : uint8_t { evalDescend, evalDone, evalFail };
+	Kind kind;
+	ExprId child;
+	double value;
+};
+
+//Interpreter for calls to pure functions with literal arguments, used by the Simplifier to replace
+//such calls by their value. It computes exactly what the generated code would (same operation order,
+//unordered comparisons, ordered '!= 0' tests), and gives up on anything codegen would reject, on a
+//call to a function not known to be pure, and once 'stepLimit' nodes have been evaluated.
+class Evaluator : public ASTVisitor<Evaluator, EvalStep> {
+
+	private:
+
+	const OperatorTable &operators;
+	//body of every pure function, by SymbolId; invalid for anything else
+	const std::vector<ExprId> &pureFunctions;
+
+	std::vector<EvalFrame> frames;
+	std::vector<double> argStack;
+	//variables of every active call, innermost last; a call only sees entries from callBase on
+	std::vector<std::pair<SymbolId, double>> env;
+	uint32_t callBase = 0;
+
+	static EvalStep descend(ExprId child) { return {EvalStep::evalDescend, child, 0.0}; }
+	static EvalStep finish(double value) { return {EvalStep::evalDone, ExprId(), value}; }
+	static EvalStep fail() { return {EvalStep::evalFail, ExprId(), 0.0}; }
+
+	//codegen's truth test
+	static bool isTrue(double v) { return v < 0.0 || v > 0.0; }
+
+	//variable of the current call, nullptr if it has none by that name
+	double* lookup(SymbolId name);
+
+	//calls pure function 'fn' with the arguments from argStack[argBase] on
+	EvalStep enterCall(EvalFrame &frame, SymbolId fn, uint32_t argBase);
+
+	double leaveCall(EvalFrame &frame, double result);
+
+	public:
+
+	uint64_t stepLimit;
+	//nodes evaluated, over every evaluate() call
+	uint64_t steps = 0;
+
+	Evaluator(ASTContext &_ast, const OperatorTable &_operators, const std::vector<ExprId> &_pureFunctions, uint64_t _stepLimit)
+		: ASTVisitor(_ast), operators(_operators), pureFunctions(_pureFunctions), stepLimit(_stepLimit) {}
+
+	//Value of 'expr', which must not refer to any variable; false if it cannot be computed in budget
+	bool evaluate(ExprId expr, double &result);
+
+	//'frame' is the node's own frame, 'child' the value of the child it last asked for
+	EvalStep visit(NumberExprAST* numExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(VariableExprAST* variableExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(BinaryExprAST* binaryExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(UnaryExprAST* unaryExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(CallExprAST* callExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(PrototypeAST* /*protoExprAST*/, EvalFrame &/*frame*/, double /*child*/) { return fail(); }
+
+	EvalStep visit(FunctionAST* /*fnExprAST*/, EvalFrame &/*frame*/, double /*child*/) { return fail(); }
+
+	EvalStep visit(IfExprAST* ifExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(ForExprAST* forExprAST, EvalFrame &frame, double child);
+
+	EvalStep visit(VarExprAST* varExprAST, EvalFrame &frame, double child);
+
+	EvalStep visitInvalid(ExprAST* /*exprAST*/, EvalFrame &/*frame*/, double /*child*/) { return fail(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef HASHCONS_DEFINED
+#define HASHCONS_DEFINED
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+namespace myCompiler {
+
+//--hash-cons: side-effect-free expressions (numbers, variables, and builtin operators other than '='
+//applied to such expressions) are built at most once per ASTContext. A repeated subtree gets the id
+//of the first one, so the AST becomes a DAG; the shared nodes are marked Pure, which also lets
+//codegen reuse their values (see Code_Gen::reuse).
+class HashConsTable {
+
+	public:
+
+	//node kind (and operator) plus the fields that identify a node of that kind
+	struct Key {
+		uint32_t kind;
+		uint32_t a;
+		uint64_t b;
+
+		bool operator==(const Key &other) const { return kind == other.kind && a == other.a && b == other.b; }
+	};
+
+	static Key numberKey(double val)
+	{
+		//bitwise, so 0.0 and -0.0 stay distinct
+		uint64_t bits;
+		memcpy(&bits, &val, sizeof(bits));
+		return {exprTypeNumber, 0, bits};
+	}
+
+	static Key variableKey(SymbolId name) { return {exprTypeVariable, name, 0}; }
+
+	//operators in functions of different FloatModes are not shared: the simplifier rewrites a shared
+	//node once, under the mode of the first function it is met in
+	static Key binaryKey(uint8_t op, ExprId LHS, ExprId RHS, FloatMode mode)
+	{
+		return {exprTypeBinaryExpr | (uint32_t)op << 8 | (uint32_t)mode << 16, LHS.index, RHS.index};
+	}
+
+	private:
+
+	struct KeyHash {
+		size_t operator()(const Key &key) const
+		{
+			uint64_t h = key.b * 0x9E3779B97F4A7C15ull;
+			h ^= ((uint64_t)key.kind << 32 | key.a) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+			return h;
+		}
+	};
+
+	std::unordered_map<Key, ExprId, KeyHash> nodes;
+	size_t hits = 0;
+
+	public:
+
+	//The node for 'key', created in 'ast' from 'args' the first time
+	template <typename T, typename ...Args>
+	ExprId create(ASTContext &ast, const Key &key, Args&& ...args)
+	{
+		auto found = nodes.find(key);
+		if (found != nodes.end()) {
+			hits++;
+			return found->second;
+		}
+		ExprId id = ast.create<T>(std::forward<Args>(args)...);
+		ast.get(id)->Pure = true;
+		nodes.emplace(key, id);
+		return id;
+	}
+
+	//nodes not created because an identical one existed
+	size_t sharedCount() const { return hits; }
+
+	//Forgets every node, for when the context they live in is cleared
+	void clear() { nodes.clear(); }
+};
+
+}
+
+#endif
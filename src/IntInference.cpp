@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Trace.h"
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "IntInference.h"
+
+namespace myCompiler {
+
+	bool IntegerInference::isInteger(ExprId id, int64_t &value) const
+	{
+		NumberExprAST* num = ast.asOrNull<NumberExprAST>(id);
+		if (!num || num->Val != std::trunc(num->Val) || std::fabs(num->Val) > (double)MaxExact)
+			return false;
+		//-0.0 is observable (1 / -0.0), an i64 zero is not
+		if (num->Val == 0 && std::signbit(num->Val))
+			return false;
+		value = (int64_t)num->Val;
+		return true;
+	}
+
+	bool IntegerInference::counterStep(ExprId value, SymbolId name, int64_t &delta) const
+	{
+		BinaryExprAST* binary = ast.asOrNull<BinaryExprAST>(value);
+		if (!binary || (binary->op != '+' && binary->op != '-'))
+			return false;
+		VariableExprAST* LHS = ast.asOrNull<VariableExprAST>(binary->LHS);
+		VariableExprAST* RHS = ast.asOrNull<VariableExprAST>(binary->RHS);
+		if (LHS && LHS->Name == name && isInteger(binary->RHS, delta)) {
+			if (binary->op == '-')
+				delta = -delta;
+			return true;
+		}
+		return binary->op == '+' && RHS && RHS->Name == name && isInteger(binary->LHS, delta);
+	}
+
+	uint32_t IntegerInference::lookup(uint32_t scope, SymbolId name) const
+	{
+		for (; scope; scope = scopes[scope].parent)
+			if (scopes[scope].name == name)
+				return scope;
+		return 0;
+	}
+
+	void IntegerInference::pushChildren(ExprAST* node, uint32_t scope)
+	{
+		ast.forEachChild(node, [&](ExprId &child) { push(child, scope); });
+	}
+
+	void IntegerInference::clear()
+	{
+		scopes.clear();
+		counters.clear();
+		integralLoops.clear();
+		integralBindings.clear();
+	}
+
+	void IntegerInference::run(ExprId body)
+	{
+		clear();
+		scopes.emplace_back(0, 0, ExprId(), NoBinding);
+
+		push(body, 0);
+		while (!pending.empty()) {
+			auto next = pending.back();
+			pending.pop_back();
+			//Pure nodes hold no assignments, loops or bindings, and may be shared many times over
+			if (!ast.get(next.first)->Pure)
+				dispatch(next.first, next.first, next.second);
+		}
+
+		//enclosing scopes come first, so a loop bounded by an outer loop sees it decided
+		for (Scope &scope : scopes)
+			if (scope.binding == NoBinding && scope.node)
+				decideLoop(scope);
+		for (uint32_t i = 1; i < scopes.size(); i++)
+			if (scopes[i].binding != NoBinding)
+				decideCounter(i);
+	}
+
+	void IntegerInference::visit(BinaryExprAST* binaryExprAST, ExprId /*id*/, uint32_t scope)
+	{
+		VariableExprAST* dest = binaryExprAST->op == '=' ? ast.asOrNull<VariableExprAST>(binaryExprAST->LHS) : nullptr;
+		if (dest) {
+			if (uint32_t target = lookup(scope, dest->Name)) {
+				scopes[target].assigned = true;
+				int64_t delta;
+				if (counterStep(binaryExprAST->RHS, dest->Name, delta))
+					counters.push_back({target, scope, delta});
+				else
+					scopes[target].notCounter = true;
+			}
+		}
+		pushChildren(binaryExprAST, scope);
+	}
+
+	void IntegerInference::visit(ForExprAST* forExprAST, ExprId id, uint32_t scope)
+	{
+		push(forExprAST->Start, scope);
+		uint32_t loop = scopes.size();
+		scopes.emplace_back(scope, forExprAST->InductionVarName, id, NoBinding);
+		push(forExprAST->End, loop);
+		push(forExprAST->Step, loop);
+		push(forExprAST->Body, loop);
+	}
+
+	void IntegerInference::visit(VarExprAST* varExprAST, ExprId /*id*/, uint32_t scope)
+	{
+		//each initializer sees the bindings before it
+		for (uint32_t i = 0; i < varExprAST->VarNames.size(); i++) {
+			VarBinding binding = ast.varBindingList(varExprAST->VarNames)[i];
+			if (binding.Init)
+				push(binding.Init, scope);
+			uint32_t next = scopes.size();
+			scopes.emplace_back(scope, binding.Name, binding.Init, varExprAST->VarNames.first + i);
+			scope = next;
+		}
+		push(varExprAST->Body, scope);
+	}
+
+	bool IntegerInference::range(uint32_t scope, int64_t &lo, int64_t &hi) const
+	{
+		const Scope &var = scopes[scope];
+		if (var.integral && var.binding == NoBinding) {
+			lo = var.lo;
+			hi = var.hi;
+			return true;
+		}
+		int64_t value = 0;
+		if (var.binding == NoBinding || var.assigned || (var.node && !isInteger(var.node, value)))
+			return false;
+		lo = hi = value;
+		return true;
+	}
+
+	void IntegerInference::decideLoop(Scope &loop)
+	{
+		ForExprAST* forExprAST = ast.as<ForExprAST>(loop.node);
+		int64_t start, step;
+		if (loop.assigned || !isInteger(forExprAST->Start, start) || !isInteger(forExprAST->Step, step) || !step)
+			return;
+
+		//the end condition must compare the variable with a bound
+		BinaryExprAST* cond = ast.asOrNull<BinaryExprAST>(forExprAST->End);
+		if (!cond || (cond->op != '<' && cond->op != '>'))
+			return;
+		VariableExprAST* LHS = ast.asOrNull<VariableExprAST>(cond->LHS);
+		bool onLeft = LHS && LHS->Name == loop.name;
+		ExprId boundId = onLeft ? cond->RHS : cond->LHS;
+		VariableExprAST* var = ast.asOrNull<VariableExprAST>(onLeft ? cond->LHS : cond->RHS);
+		if (!var || var->Name != loop.name)
+			return;
+
+		int64_t boundLo, boundHi;
+		if (isInteger(boundId, boundLo))
+			boundHi = boundLo;
+		else {
+			VariableExprAST* bound = ast.asOrNull<VariableExprAST>(boundId);
+			uint32_t boundScope = bound ? lookup(loop.parent, bound->Name) : 0;
+			if (!boundScope || !range(boundScope, boundLo, boundHi))
+				return;
+		}
+
+		//the loop goes on while the variable is below (i < b, b > i) or above the bound, and stops at
+		//most one step past it
+		bool below = (cond->op == '<') == onLeft;
+		if (below != (step > 0))
+			return;
+		if (below) {
+			loop.lo = start;
+			loop.hi = std::max(start, boundHi) + step;
+		}
+		else {
+			loop.lo = std::min(start, boundLo) + step;
+			loop.hi = start;
+		}
+		if (loop.lo < -MaxExact || loop.hi > MaxExact)
+			return;
+
+		int64_t magnitude = step > 0 ? step : -step;
+		loop.trips = (loop.hi - loop.lo) / magnitude + 1;
+		loop.integral = true;
+		integralLoops.insert(loop.node.index);
+		loopsInferred++;
+	}
+
+	void IntegerInference::decideCounter(uint32_t index)
+	{
+		Scope &var = scopes[index];
+		int64_t start = 0;
+		if (var.notCounter || (var.node && !isInteger(var.node, start)))
+			return;
+
+		//how far all the assignments together can move the counter
+		int64_t reach = 0;
+		for (const Counter &counter : counters) {
+			if (counter.scope != index)
+				continue;
+			int64_t times = 1;
+			for (uint32_t at = counter.at; at != index; at = scopes[at].parent) {
+				const Scope &enclosing = scopes[at];
+				if (enclosing.binding != NoBinding)
+					continue;
+				if (!enclosing.integral || __builtin_mul_overflow(times, enclosing.trips, &times) || times > MaxExact)
+					return;
+			}
+			int64_t step = counter.delta > 0 ? counter.delta : -counter.delta;
+			if (__builtin_mul_overflow(times, step, &times) || times > MaxExact)
+				return;
+			reach += times;
+			if (reach > MaxExact)
+				return;
+		}
+		if (start - reach < -MaxExact || start + reach > MaxExact)
+			return;
+
+		var.integral = true;
+		var.lo = start - reach;
+		var.hi = start + reach;
+		integralBindings.insert(var.binding);
+		countersInferred++;
+		KTRACE(tracePass, traceDebug, "integer counter", "binding", var.binding, "lo", var.lo, "hi", var.hi);
+	}
+
+}
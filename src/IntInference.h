@@ -0,0 +1,132 @@
+#ifndef INTINFERENCE_DEFINED
+#define INTINFERENCE_DEFINED
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "ASTVisitor.h"
+
+namespace myCompiler {
+
+//Finds the variables of a function that only ever hold integers small enough (|v| <= 2^53) for every
+//value to be exact as a double, so codegen can keep them in i64 and convert to double only where a
+//value is read. Such a variable gives LLVM an integer induction variable with a known trip count.
+//
+//  - the induction variable of a 'for' whose start and step are integer literals (step not 0), that
+//    is never assigned, and whose end condition compares it ('<' or '>') with an integer literal or
+//    with the induction variable of an enclosing integer loop, in the direction the step moves it
+//  - a 'var' counter initialized to an integer literal (or nothing) whose every assignment is
+//    'c = c + k', 'c = k + c' or 'c = c - k' with an integer literal k, and where every assignment
+//    sits in integer loops only, so the number of times it runs, and with it the range, is bounded
+//
+//Ranges are computed from the literals, so anything that cannot be bounded stays a double.
+class IntegerInference : public ASTVisitor<IntegerInference, void> {
+
+	private:
+
+	//a variable in scope: the function itself (index 0), a loop's induction variable or a 'var' binding
+	struct Scope {
+		uint32_t parent;
+		SymbolId name;
+		//the 'for', or the initializer of the binding
+		ExprId node;
+		//index of the binding in ASTContext::varBindings, NoBinding for a loop
+		uint32_t binding;
+		bool assigned = false;
+		//assigned other than as a counter
+		bool notCounter = false;
+		bool integral = false;
+		int64_t lo = 0, hi = 0;
+		//iterations of an integral loop, at most
+		int64_t trips = 0;
+
+		Scope(uint32_t _parent, SymbolId _name, ExprId _node, uint32_t _binding)
+			: parent(_parent), name(_name), node(_node), binding(_binding) {}
+	};
+
+	static constexpr uint32_t NoBinding = 0xFFFFFFFF;
+
+	//'c = c + delta' on the variable of 'scope', made by code evaluated in scope 'at'
+	struct Counter {
+		uint32_t scope;
+		uint32_t at;
+		int64_t delta;
+	};
+
+	std::vector<Scope> scopes;
+	std::vector<Counter> counters;
+	std::vector<std::pair<ExprId, uint32_t>> pending;
+
+	std::unordered_set<uint32_t> integralLoops;
+	std::unordered_set<uint32_t> integralBindings;
+
+	//scope declaring 'name' as seen from 'scope', 0 if none
+	uint32_t lookup(uint32_t scope, SymbolId name) const;
+
+	void push(ExprId id, uint32_t scope) { pending.emplace_back(id, scope); }
+
+	void pushChildren(ExprAST* node, uint32_t scope);
+
+	//range of an integral variable, or of a 'var' that is never assigned and holds an integer literal
+	bool range(uint32_t scope, int64_t &lo, int64_t &hi) const;
+
+	void decideLoop(Scope &loop);
+
+	void decideCounter(uint32_t index);
+
+	public:
+
+	//largest magnitude of a value kept in i64
+	static const int64_t MaxExact = int64_t(1) << 53;
+
+	IntegerInference(ASTContext &_ast) : ASTVisitor(_ast) {}
+
+	//true and the value when 'id' is a literal integer within MaxExact, other than -0.0
+	bool isInteger(ExprId id, int64_t &value) const;
+
+	//the change 'c = c + k' / 'c = k + c' / 'c = c - k' makes to 'name', when 'value' has that form
+	bool counterStep(ExprId value, SymbolId name, int64_t &delta) const;
+
+	//Decides every loop and 'var' binding of a function body, replacing the previous function's results
+	void run(ExprId body);
+
+	void clear();
+
+	bool isIntegralLoop(ExprId forNode) const { return integralLoops.count(forNode.index) != 0; }
+	bool isIntegralBinding(uint32_t binding) const { return integralBindings.count(binding) != 0; }
+
+	//Each visit() is passed the node's id and the scope it is evaluated in
+	void visit(NumberExprAST* /*numExprAST*/, ExprId /*id*/, uint32_t /*scope*/) {}
+
+	void visit(VariableExprAST* /*variableExprAST*/, ExprId /*id*/, uint32_t /*scope*/) {}
+
+	void visit(BinaryExprAST* binaryExprAST, ExprId id, uint32_t scope);
+
+	void visit(UnaryExprAST* unaryExprAST, ExprId /*id*/, uint32_t scope) { pushChildren(unaryExprAST, scope); }
+
+	void visit(CallExprAST* callExprAST, ExprId /*id*/, uint32_t scope) { pushChildren(callExprAST, scope); }
+
+	void visit(PrototypeAST* /*protoExprAST*/, ExprId /*id*/, uint32_t /*scope*/) {}
+
+	void visit(FunctionAST* /*fnExprAST*/, ExprId /*id*/, uint32_t /*scope*/) {}
+
+	void visit(IfExprAST* ifExprAST, ExprId /*id*/, uint32_t scope) { pushChildren(ifExprAST, scope); }
+
+	void visit(ForExprAST* forExprAST, ExprId id, uint32_t scope);
+
+	void visit(VarExprAST* varExprAST, ExprId id, uint32_t scope);
+
+	//for stats
+	size_t loopsInferred = 0;
+	size_t countersInferred = 0;
+};
+
+}
+
+#endif
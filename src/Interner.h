@@ -0,0 +1,120 @@
+#ifndef INTERNER_DEFINED
+#define INTERNER_DEFINED
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Maps identifier spellings to dense 32-bit ids. Spellings are copied into an arena owned by the
+//interner, so ids (and the views returned by str()) stay valid after the source buffer is gone.
+class StringInterner {
+
+	private:
+
+	static const size_t ArenaChunkSize = 64 * 1024;
+	static constexpr uint32_t EmptySlot = 0xFFFFFFFF;
+
+	std::vector<std::string_view> strings;
+	std::vector<uint32_t> hashes;
+	//open addressing, power of two size, holds ids
+	std::vector<uint32_t> slots;
+	std::vector<std::unique_ptr<char[]>> arena;
+	std::vector<std::unique_ptr<char[]>> oversized;
+	size_t arenaUsed;
+
+	static uint32_t hash(std::string_view str)
+	{
+		//FNV-1a
+		uint32_t h = 2166136261u;
+		for (char c : str) {
+			h ^= (unsigned char)c;
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	const char* copy(std::string_view str)
+	{
+		//long spellings get an allocation of their own so the current chunk keeps filling
+		if (str.size() > ArenaChunkSize / 4) {
+			oversized.emplace_back(new char[str.size()]);
+			memcpy(oversized.back().get(), str.data(), str.size());
+			return oversized.back().get();
+		}
+		if (arena.empty() || arenaUsed + str.size() > ArenaChunkSize) {
+			arena.emplace_back(new char[ArenaChunkSize]);
+			arenaUsed = 0;
+		}
+		char* data = arena.back().get() + arenaUsed;
+		memcpy(data, str.data(), str.size());
+		arenaUsed += str.size();
+		return data;
+	}
+
+	void grow()
+	{
+		std::vector<uint32_t> newSlots(slots.empty() ? 256 : slots.size() * 2, EmptySlot);
+		size_t mask = newSlots.size() - 1;
+		for (uint32_t id = 0; id < strings.size(); id++) {
+			size_t i = hashes[id] & mask;
+			while (newSlots[i] != EmptySlot)
+				i = (i + 1) & mask;
+			newSlots[i] = id;
+		}
+		slots.swap(newSlots);
+	}
+
+	//slot holding 'str', or the empty slot where it would go
+	size_t slotOf(std::string_view str, uint32_t h) const
+	{
+		size_t mask = slots.size() - 1;
+		size_t i = h & mask;
+		while (slots[i] != EmptySlot) {
+			uint32_t id = slots[i];
+			if (hashes[id] == h && strings[id] == str)
+				return i;
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	public:
+
+	//returned by find() for a string that was never interned
+	static constexpr uint32_t NotInterned = EmptySlot;
+
+	StringInterner() : arenaUsed(0) {
+		grow();
+	}
+
+	//Never adds a string, so threads may call it as long as nobody interns meanwhile
+	uint32_t find(std::string_view str) const
+	{
+		return slots[slotOf(str, hash(str))];
+	}
+
+	uint32_t intern(std::string_view str)
+	{
+		uint32_t h = hash(str);
+		size_t i = slotOf(str, h);
+		if (slots[i] != EmptySlot)
+			return slots[i];
+
+		uint32_t id = strings.size();
+		strings.emplace_back(copy(str), str.size());
+		hashes.push_back(h);
+		slots[i] = id;
+		if (strings.size() * 2 > slots.size())
+			grow();
+		return id;
+	}
+
+	std::string_view str(uint32_t id) const { return strings[id]; }
+
+	size_t size() const { return strings.size(); }
+};
+
+#endif
@@ -1,8 +1,21 @@
+#ifndef LEXER_DEFINED
+#define LEXER_DEFINED
+
 #include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <array>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <fstream>
+#include <memory>
+#include <iostream>
+
+#include "SourceBuffer.h"
+#include "CharScan.h"
+#include "Interner.h"
+#include "Trace.h"
 
 using namespace std;
 
@@ -10,29 +23,66 @@ class lexer {
 
     private:
 
-    std::ifstream fileHandle;
-	char LastChar;
-	bool printLog;
+    std::unique_ptr<SourceBuffer> source;
+	//identifiers are interned as they are lexed; shared with the parser and codegen
+	StringInterner* identifiers;
+	//scan window into the source; tokStart marks the first byte of the token being built
+	const char* cur;
+	const char* end;
+	const char* tokStart;
 
-    public:
+	//absolute input offset of windowBase; windows move on every refill of the chunked reader
+	const char* windowBase;
+	size_t windowOffset;
+	//1-based line of cur and the input offset where that line starts
+	uint32_t line;
+	size_t lineStartOffset;
+	uint32_t tokLine;
+	uint32_t tokColumn;
 
-    lexer (char fileName[], bool _printLog) : printLog(_printLog)
-    {
-        std::cout << "Lexer::lexer(): create file handle" << std::endl << std::flush;
-        fileHandle.open(fileName);
-		LastChar = ' ';
-    }
+	size_t offsetOf(const char* p) { return windowOffset + (p - windowBase); }
 
-	void LexerLog(std::string str) {
-		if (printLog) {
-			std::cout << "Lexer: " << str << std::endl;
-		}
+	bool refill()
+	{
+		size_t tokOffset = offsetOf(tokStart);
+		if (!source->refill(cur, tokStart, end))
+			return false;
+		windowBase = tokStart;
+		windowOffset = tokOffset;
+		return true;
 	}
 
-	/*~lexer()
+	//next unread byte, or EOF once the input is exhausted
+	int peekChar()
 	{
-		fileHandle.close();
-	}*/
+		if (cur == end && !refill())
+			return EOF;
+		return (unsigned char)*cur;
+	}
+
+	void countLines(const char* from, const char* to)
+	{
+		if (from == to)
+			return;
+		while (const char* nl = (const char*)memchr(from, '\n', to - from)) {
+			line++;
+			lineStartOffset = offsetOf(nl) + 1;
+			from = nl + 1;
+		}
+	}
+
+    public:
+
+    lexer (char fileName[], StringInterner &_identifiers) : identifiers(&_identifiers)
+    {
+        KTRACE(traceLexer, traceInfo, "open source", "file", fileName);
+        source = SourceBuffer::open(fileName);
+		source->window(cur, end);
+		tokStart = windowBase = cur;
+		windowOffset = 0;
+		line = 1;
+		lineStartOffset = 0;
+    }
 
     enum Token{
 	    tok_eof = -1,
@@ -60,128 +110,153 @@ class lexer {
     
     struct tokStruct{
 	    Token tok;
-	    double numVal;
-	    std::string identifierStr;
-        char unknownChar;
+	    double numVal = 0.0;
+	    //interned spelling, valid for the lifetime of the interner
+	    std::string_view identifierStr;
+	    uint32_t identId = 0;
+        char unknownChar = 0;
+        uint32_t line = 0;
+        uint32_t column = 0;
 
         tokStruct(Token _tok) : tok(_tok){
         }
 
-        tokStruct(std::string identifier) : tok(tok_identifier), identifierStr(identifier){
+        tokStruct(std::string_view identifier, uint32_t id) : tok(tok_identifier), identifierStr(identifier), identId(id){
         }
 
         tokStruct(char unknown) : tok(tok_unknown), unknownChar(unknown){
-			std::cout << "tokStruct() " << this->unknownChar << std::endl << std::flush;
         }
 
         tokStruct(double number) : tok(tok_number), numVal(number){
         }
-
-		tokStruct& operator=(const tokStruct& other){
-			tok = other.tok;
-			numVal = other.numVal;
-			identifierStr = other.identifierStr;
-			unknownChar = other.unknownChar;
-			return *this;
-		}
     };
     
 
+	//Keywords resolve through a perfect hash on the second character and the length; the hash only picks
+	//the slot and a single memcmp confirms the match.
+	struct keywordEntry {
+		const char* str;
+		unsigned char len;
+		Token tok;
+	};
+
+	static constexpr unsigned keywordHash(const char* str, size_t len)
+	{
+		return ((unsigned char)str[1] + (len << 2)) & 15;
+	}
+
+	static constexpr std::array<keywordEntry, 16> makeKeywordTable()
+	{
+		const keywordEntry keywords[] = {
+			{"def", 3, tok_def}, {"extern", 6, tok_extern}, {"if", 2, tok_if}, {"then", 4, tok_then},
+			{"else", 4, tok_else}, {"for", 3, tok_for}, {"in", 2, tok_in}, {"var", 3, tok_var},
+		};
+		std::array<keywordEntry, 16> table = {};
+		for (const keywordEntry& kw : keywords)
+			table[keywordHash(kw.str, kw.len)] = kw;
+		return table;
+	}
+
+	static constexpr bool keywordHashIsPerfect()
+	{
+		std::array<keywordEntry, 16> table = makeKeywordTable();
+		int used = 0;
+		for (const keywordEntry& kw : table)
+			used += kw.str != nullptr;
+		return used == 8;
+	}
+
+	static Token lookupKeyword(std::string_view str)
+	{
+		static_assert(keywordHashIsPerfect(), "keyword hash collides");
+		static constexpr std::array<keywordEntry, 16> table = makeKeywordTable();
+		if (str.size() < 2 || str.size() > 6)
+			return tok_identifier;
+		const keywordEntry& kw = table[keywordHash(str.data(), str.size())];
+		if (kw.len == str.size() && memcmp(kw.str, str.data(), kw.len) == 0)
+			return kw.tok;
+		return tok_identifier;
+	}
+
+	tokStruct located(tokStruct tok)
+	{
+		tok.line = tokLine;
+		tok.column = tokColumn;
+		return tok;
+	}
+
+	//bytes handed out by the source so far, for throughput reporting
+	size_t bytesRead() { return source->bytesRead(); }
+
     tokStruct getTok()
     {
-        //std::cout << "Lexer::getTok()" << std::endl << std::flush;
-        //std::string identifierStr;
-		std:string msg = "Lexer::getTok() begin:LastChar:";
-		msg += LastChar;
-        LexerLog(msg);
-		
-			
-        while (std::isspace(LastChar)) {
-		    fileHandle.get(LastChar);
-			msg = "Lexer::getTok():LastChar ";
-			msg += LastChar;
-            LexerLog(msg);
-			if (!fileHandle)
+		while (1) {
+			//whitespace carries nothing into a refill, so tokStart follows cur
+			while (1) {
+				const char* from = cur;
+				cur = charScan::skipSpace(cur, end);
+				countLines(from, cur);
+				tokStart = cur;
+				if (cur != end || !refill())
+					break;
+			}
+			tokLine = line;
+			tokColumn = offsetOf(tokStart) - lineStartOffset + 1;
+
+			if (cur == end)
 			{
-				LexerLog("Reached EOF");
-				return tokStruct(tok_eof);
+				KTRACE(traceLexer, traceDebug, "eof", "line", tokLine, "col", tokColumn);
+				return located(tokStruct(tok_eof));
 			}
-        }
-	
-        std::string curString = "";
-        if (isalpha(LastChar))
-        {
-            curString += LastChar;
-            while(isalnum(LastChar))
-            {
-		        fileHandle.get(LastChar);
-				if (std::isspace(LastChar) || (LastChar == '(') || (LastChar == ')') ||(LastChar == ',') || (LastChar == ';'))
-					break;
-                curString += LastChar;
-            }
-			msg = "Lexer::getTok(): ";
-			msg += curString;
-            LexerLog(msg);
-
-            if (curString.compare("def") == 0)
-                return tokStruct(Token::tok_def);
-            else if (curString.compare("extern") == 0)
-                return tokStruct(Token::tok_extern);
-			else if (curString.compare("if") == 0)
-                return tokStruct(Token::tok_if);
-			else if (curString.compare("then") == 0)
-                return tokStruct(Token::tok_then);
-			else if (curString.compare("else") == 0)
-                return tokStruct(Token::tok_else);
-			else if (curString.compare("for") == 0)
-                return tokStruct(Token::tok_for);
-			else if (curString.compare("in") == 0)
-                return tokStruct(Token::tok_in);
-			else if (curString.compare("var") == 0)
-                return tokStruct(Token::tok_var);
-            return tokStruct(curString);
-            
-        }
 
-        if (isdigit(LastChar) || LastChar == '.')
-        {
-            std::string NumStr;
-            do {
-                NumStr += LastChar;
-		        fileHandle.get(LastChar);
-            } while(isdigit(LastChar) || LastChar == '.');
+			unsigned char c = *cur;
+			if (charScan::is(c, charScan::ccAlpha))
+			{
+				++cur;
+				while (1) {
+					cur = charScan::skipAlnum(cur, end);
+					if (cur != end || !refill())
+						break;
+				}
+				std::string_view curString(tokStart, cur - tokStart);
+				KTRACE(traceLexer, traceDebug, "word", "text", curString, "line", tokLine, "col", tokColumn);
 
-            double NumVal = strtod(NumStr.c_str(), 0);
-            return tokStruct(NumVal);
-        }
+				Token keyword = lookupKeyword(curString);
+				if (keyword != tok_identifier)
+					return located(tokStruct(keyword));
+				uint32_t id = identifiers->intern(curString);
+				return located(tokStruct(identifiers->str(id), id));
+			}
 
-        if (LastChar == '#') 
-        {
-           // Comment until end of line.
-           do{
-		        fileHandle.get(LastChar);
-           } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-        
-           if (LastChar != EOF)
-               return getTok();
-  
-        }
+			if (charScan::is(c, charScan::ccDigit | charScan::ccDot))
+			{
+				do {
+					++cur;
+				} while (charScan::is(peekChar(), charScan::ccDigit | charScan::ccDot));
 
-		
-        //if unknown character, just return the character
-		char tempChar = LastChar;
-        fileHandle.get(LastChar);
-		msg = "Lexer LastChar: ";
-		msg += LastChar;
-		LexerLog(msg);
-		if (!fileHandle)
-		{
-			LexerLog("Reached EOF");
-			return tokStruct(tok_eof);
+				double numVal = charScan::parseNumber(tokStart, cur);
+				KTRACE(traceLexer, traceDebug, "number", "value", numVal, "line", tokLine, "col", tokColumn);
+				return located(tokStruct(numVal));
+			}
+
+			if (c == '#')
+			{
+				// Comment until end of line.
+				while (1) {
+					cur = charScan::findEOL(cur, end);
+					tokStart = cur;
+					if (cur != end || !refill())
+						break;
+				}
+				continue;
+			}
+
+			//if unknown character, just return the character
+			++cur;
+			KTRACE(traceLexer, traceDebug, "char", "text", (char)c, "line", tokLine, "col", tokColumn);
+			return located(tokStruct((char)c));
 		}
-		msg = "Lexer:tempChar ";
-		msg += tempChar;
-		LexerLog(msg);
-        return tokStruct(tempChar);
     }
 };
+
+#endif
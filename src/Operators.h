@@ -0,0 +1,138 @@
+#ifndef OPERATORS_DEFINED
+#define OPERATORS_DEFINED
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Operators are identified by an 8-bit id. A single-character operator's id is the character itself;
+//operators spelled with several characters ("**", "<=") get ids from 128 up as they are declared.
+typedef uint8_t OperatorId;
+
+//Precedence and associativity for every operator id. precedence < 0 means "not a binary operator".
+struct OperatorInfo {
+	int8_t precedence = -1;
+	bool rightAssoc = false;
+	//usable as a prefix operator
+	bool unary = false;
+	//handled directly by codegen, cannot be redefined
+	bool builtin = false;
+};
+
+//Characters operators may be spelled with. Parentheses, ',' and ';' are never part of an operator.
+static constexpr bool isOperatorChar(unsigned char c)
+{
+	switch (c) {
+		case '!': case '%': case '&': case '*': case '+': case '-': case '/': case ':':
+		case '<': case '=': case '>': case '?': case '@': case '^': case '|': case '~':
+			return true;
+		default:
+			return false;
+	}
+}
+
+static constexpr std::array<OperatorInfo, 256> makeBuiltinOperators()
+{
+	std::array<OperatorInfo, 256> table = {};
+	struct { char op; int8_t precedence; bool rightAssoc; } builtins[] = {
+		{':', 1, false},
+		{'=', 2, true},
+		{'|', 5, false}, {'&', 6, false},
+		{'<', 10, false}, {'>', 10, false},
+		{'+', 20, false}, {'-', 20, false},
+		{'*', 40, false}, {'/', 40, false},
+	};
+	for (auto &b : builtins) {
+		OperatorInfo &info = table[(unsigned char)b.op];
+		info.precedence = b.precedence;
+		info.rightAssoc = b.rightAssoc;
+		info.builtin = true;
+	}
+	return table;
+}
+
+static constexpr std::array<OperatorInfo, 256> builtinOperators = makeBuiltinOperators();
+
+//Operator table the parser consults on every binary operator. It starts as a copy of the builtin
+//table and grows as the program declares operators with 'def binary' / 'def unary'.
+class OperatorTable {
+
+	private:
+
+	static constexpr uint32_t NoFunction = 0xFFFFFFFF;
+
+	std::array<OperatorInfo, 256> table = builtinOperators;
+	//interned name of the function implementing each user-defined operator
+	std::array<uint32_t, 256> binaryFns;
+	std::array<uint32_t, 256> unaryFns;
+	//spellings of ids 128..255
+	std::vector<std::string> spellings;
+	//characters that start a multi-character operator; only after those does the parser look ahead
+	std::array<bool, 256> multiCharStart = {};
+
+	public:
+
+	OperatorTable() {
+		binaryFns.fill(NoFunction);
+		unaryFns.fill(NoFunction);
+	}
+
+	const OperatorInfo& info(OperatorId op) const { return table[op]; }
+
+	int precedence(OperatorId op) const { return table[op].precedence; }
+
+	bool startsMultiChar(unsigned char c) const { return multiCharStart[c]; }
+
+	//Id of a spelling, or 0 if no operator is spelled that way
+	OperatorId lookup(std::string_view spelling) const
+	{
+		if (spelling.size() == 1)
+			return (unsigned char)spelling[0];
+		for (size_t i = 0; i < spellings.size(); i++)
+			if (spellings[i] == spelling)
+				return 128 + i;
+		return 0;
+	}
+
+	std::string spelling(OperatorId op) const
+	{
+		if (op < 128)
+			return std::string(1, (char)op);
+		return spellings[op - 128];
+	}
+
+	//Id for a spelling, allocating one for a new multi-character spelling; 0 once all ids are used
+	OperatorId declare(std::string_view spelling)
+	{
+		if (OperatorId op = lookup(spelling))
+			return op;
+		if (spellings.size() == 128)
+			return 0;
+		spellings.emplace_back(spelling);
+		multiCharStart[(unsigned char)spelling[0]] = true;
+		return 128 + spellings.size() - 1;
+	}
+
+	void defineBinary(OperatorId op, int precedence, uint32_t fn)
+	{
+		table[op].precedence = precedence;
+		table[op].rightAssoc = false;
+		binaryFns[op] = fn;
+	}
+
+	void defineUnary(OperatorId op, uint32_t fn)
+	{
+		table[op].unary = true;
+		unaryFns[op] = fn;
+	}
+
+	//Function implementing a user-defined operator
+	bool hasBinaryFunction(OperatorId op) const { return binaryFns[op] != NoFunction; }
+	bool hasUnaryFunction(OperatorId op) const { return unaryFns[op] != NoFunction; }
+	uint32_t binaryFunction(OperatorId op) const { return binaryFns[op]; }
+	uint32_t unaryFunction(OperatorId op) const { return unaryFns[op]; }
+};
+
+#endif
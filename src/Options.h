@@ -0,0 +1,77 @@
+#ifndef OPTIONS_DEFINED
+#define OPTIONS_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//--select-if: when an 'if' with side-effect-free arms is emitted as a select instead of branches
+enum SelectIfMode { selectIfNever, selectIfAuto, selectIfAlways };
+
+//--fp-flags / --ffast-math: the fast-math flags put on floating point instructions, as in LLVM
+enum FPFlag : unsigned {
+	fpNoNaNs = 1 << 0,
+	fpNoInfs = 1 << 1,
+	fpNoSignedZeros = 1 << 2,
+	fpReassoc = 1 << 3,
+	fpReciprocal = 1 << 4,
+	fpApproxFunc = 1 << 5,
+	fpAllFlags = (1 << 6) - 1
+};
+
+//flags under which the simplifier's identities that do not hold for every IEEE value hold
+const unsigned fpSimplifyFlags = fpNoNaNs | fpNoInfs | fpNoSignedZeros | fpReassoc;
+
+//--fp-contract: off never fuses, on fuses a multiply feeding an add or subtract in the same
+//expression (llvm.fmuladd), fast lets the backend fuse any multiply and add
+enum FPContractMode { fpContractOff, fpContractOn, fpContractFast };
+
+//Command line settings that change how a source file is compiled, see main.cpp for the flags
+struct CompileOptions {
+	//--prelex: lex the whole input before parsing
+	bool prelex = false;
+	//--echo-ir: print each function's IR to stderr as it is generated
+	bool echoIR = false;
+	//--jobs: threads parsing top-level items, implies prelex
+	unsigned jobs = 1;
+	//--hash-cons: share identical side-effect-free subtrees
+	bool hashCons = false;
+	//--no-simplify turns off constant folding and simplification of the AST
+	bool simplify = true;
+	//--eval-steps: nodes the simplifier may evaluate per call to a pure function with literal
+	//arguments before leaving the call to run time; 0 evaluates no calls
+	uint64_t evalSteps = 1000000;
+	//--specialize-budget: AST nodes the simplifier may copy, over the whole compile, into clones of
+	//small functions specialized for the literal arguments of a call; 0 specializes nothing
+	uint64_t specializeBudget = 2000;
+	//--auto-memoize: cache the results of pure self-recursive functions, in tables of memoEntries
+	//results each (rounded up to a power of two)
+	bool autoMemoize = false;
+	uint32_t memoEntries = 4096;
+	//--tail-accumulate: turn 'x * f(...)' and 'f(...) + x' in tail position of f into a loop with an
+	//accumulator; reassociates floating point arithmetic
+	bool tailAccumulate = false;
+	//--no-int-inference: keep every variable a double, even loop counters proven integral
+	bool inferIntegers = true;
+	//--no-direct-ssa: give every argument and variable a stack slot, assigned or not
+	bool directSSA = true;
+	//-O0 to -O3, -Os (size, at the speed of -O2)
+	unsigned optLevel = 0;
+	bool optSize = false;
+	//--mcpu: a CPU name, or "native" for the host's CPU and features; --mattr: features such as
+	//"+avx2,-fma" on top of those. Empty for the generic CPU.
+	std::string cpu;
+	std::string features;
+	//--multiversion: clones per x86-64 ISA level with a dispatcher; --multiversion-force picks the
+	//clone of that level (0 baseline to 3 for v4) instead of detecting it, -1 detects
+	bool multiversion = false;
+	int forceIsaLevel = -1;
+	//--fp-flags, --fp-contract (--ffast-math sets every flag and fast contraction); functions
+	//defined with 'def fast' or 'def strict' ignore both
+	unsigned fpFlags = 0;
+	FPContractMode fpContract = fpContractOff;
+	//--select-if: never, auto (arms cheap enough, see Code_Gen::SelectCostLimit) or always
+	SelectIfMode selectIf = selectIfAuto;
+};
+
+#endif
@@ -9,6 +9,12 @@
 #include <fstream>
 #include <utility>
 #include <iostream>
+#include <string_view>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
+
+#include "Stats.h"
 
 #ifndef AST_DEFINED
 #include "AST.h"
@@ -26,534 +32,864 @@ using namespace std;
 namespace myCompiler {
 
     //sets member 'nextToken' so the next token is visible to the main loop when getNextToken is called by one of the 'ParseIdentifierExpr' type functions
-    tokStruct Parser::getNextToken() {
-		ParserLog("Parser getNextToken: ");
-        m_curToken = lex.getTok();
-		std::string msg = "curToken.unknownChar ";
-		msg += m_curToken.unknownChar;
-        ParserLog(msg);
+    tokStruct ExprParser::getNextToken() {
+		if (tokens)
+			m_curToken = tokIndex < tokEnd ? tokens->get(tokIndex++) : tokStruct(lexer::tok_eof);
+		else if (!lookahead.empty()) {
+			m_curToken = lookahead.front();
+			lookahead.pop_front();
+		}
+		else
+			m_curToken = lex->getTok();
+		KTRACE(traceParser, traceDebug, "next token", "kind", (int)m_curToken.tok, "char", m_curToken.unknownChar,
+			   "line", m_curToken.line, "col", m_curToken.column);
 		
         return m_curToken;
     }
 
-    std::shared_ptr<ExprAST> Parser::ParseNumberExpr()
+    tokStruct ExprParser::peekToken(size_t n) {
+		if (tokens)
+			return tokIndex + n - 1 < tokEnd ? tokens->get(tokIndex + n - 1) : tokStruct(lexer::tok_eof);
+		while (lookahead.size() < n)
+			lookahead.push_back(lex->getTok());
+		return lookahead[n - 1];
+    }
+
+    ExprId ExprParser::ParseNumberExpr()
     {
-		ParserLog("ParseNumberExpr numVal:");
-        auto newASTNode = make_shared<NumberExprAST>(m_curToken.numVal);
+		KTRACE(traceParser, traceDebug, "ParseNumberExpr", "value", m_curToken.numVal);
+        double val = m_curToken.numVal;
+        auto newASTNode = hashCons ? shared.create<NumberExprAST>(ast, HashConsTable::numberKey(val), val) : ast.create<NumberExprAST>(val);
 		getNextToken();
         return newASTNode;
     }
 
-    //called when current token is '('
-    std::shared_ptr<ExprAST> Parser::ParseParenExpr() {
-        //tokStruct curTok = getNextToken();
-        getNextToken();
-        auto parenExpr = ParseExpression();
-
-        if (!parenExpr)
-        {
-            return nullptr;
-        }
-
-        getNextToken();
-        if (m_curToken.unknownChar != ')')
-        {
-            ParserLog("expected ')'");
-        }
-
-        return parenExpr;
+    ExprId ExprParser::CreateVariable(SymbolId name)
+    {
+		if (hashCons)
+			return shared.create<VariableExprAST>(ast, HashConsTable::variableKey(name), name);
+		return ast.create<VariableExprAST>(name);
+    }
 
+    ExprId ExprParser::CreateBinary(OperatorId op, ExprId LHS, ExprId RHS)
+    {
+		//user-defined operators are calls and '=' stores, neither can be shared
+		if (hashCons && operators.info(op).builtin && op != '=' && ast.get(LHS)->Pure && ast.get(RHS)->Pure)
+			return shared.create<BinaryExprAST>(ast, HashConsTable::binaryKey(op, LHS, RHS, floatMode), op, LHS, RHS);
+		return ast.create<BinaryExprAST>(op, LHS, RHS);
     }
 
-    std::shared_ptr<ExprAST> Parser::ParseIdentifierExpr()
+    bool ExprParser::adjacent(const tokStruct &first, const tokStruct &second)
     {
-		ParserLog("Parse identifierExpr");
-        tokStruct curTok = m_curToken;
-        getNextToken();
-        tokStruct nextTok = m_curToken;
+		return first.line == second.line && first.column + 1 == second.column;
+    }
 
-        if (nextTok.unknownChar != '(') {
-			ParserLog("Parse identifierExpr '(' not found return VariableExprAST ");
-            return make_shared<VariableExprAST> (curTok.identifierStr);
+    OperatorId ExprParser::peekOperator(size_t &length)
+    {
+		length = 0;
+		if (m_curToken.tok != lexer::tok_unknown || !isOperatorChar(m_curToken.unknownChar))
+			return 0;
+
+		OperatorId op = (unsigned char)m_curToken.unknownChar;
+		length = 1;
+		//only characters that begin a declared multi-character operator need lookahead
+		if (!operators.startsMultiChar(op))
+			return op;
+
+		//longest declared spelling made of this token and the operator characters directly after it
+		std::string spelling(1, m_curToken.unknownChar);
+		tokStruct prev = m_curToken;
+		for (size_t n = 1; ; n++) {
+			tokStruct next = peekToken(n);
+			if (next.tok != lexer::tok_unknown || !isOperatorChar(next.unknownChar) || !adjacent(prev, next))
+				break;
+			spelling += next.unknownChar;
+			if (OperatorId longer = operators.lookup(spelling)) {
+				op = longer;
+				length = n + 1;
+			}
+			prev = next;
 		}
-		ParserLog("Parse identifierExpr found '(' parsing callExpr ");
-        
-		getNextToken();
-        nextTok = m_curToken;
-        std::vector<std::shared_ptr<ExprAST>> Args;
-        
-        if (nextTok.unknownChar != ')')
-        {
-			ParserLog("Parse identifierExpr parsing callExpr Arguments ");
-            while(1)
-            {
-                if (auto Arg = ParseExpression()) {
-					std::cout << "ParseIdentifierExpr Parsed one argument " << std::endl;
-                    Args.push_back(Arg);
-				}
-                else
-                    return nullptr;
-				
-				if (m_curToken.unknownChar == ')') {
-					ParserLog("Parse identifierExpr found ')' stopping parsing of call arguments ");
-					break;
-				}
-				
-				getNextToken();
-            
-                
-				/*if (m_curToken.unknownChar == ')') {
-					std::cout << "Parse identifierExpr found ')' stopping parsing of call arguments " << std::endl;
-					break;
-				}*/
-				
-                if ((m_curToken.tok == lexer::Token::tok_unknown) && ((m_curToken.unknownChar != ')') && (m_curToken.unknownChar != ','))) {
-                    ParserLog("Expected ')' or ',' in argument list");
-                    return nullptr;
-                }
+		return op;
+    }
 
-                getNextToken();
-             }
+    void ExprParser::consumeOperator(size_t length)
+    {
+		for (size_t i = 0; i < length; i++)
+			getNextToken();
+    }
 
+    void ExprParser::pushExpression()
+    {
+		ParseFrame frame(ParseFrame::frameExpr);
+		frame.operandBase = operandStack.size();
+		frame.operatorBase = operatorStack.size();
+		parseFrames.push_back(frame);
+    }
 
-        }
-        //getNextToken();
-		ParserLog("ParseIdentifierExpr: returning CallExprAST");
-        return make_shared<CallExprAST>(curTok.identifierStr, Args);
+    void ExprParser::pushConstruct(ParseFrame::Kind kind, SymbolId name)
+    {
+		ParseFrame frame(kind);
+		frame.name = name;
+		frame.listBase = kind == ParseFrame::frameVar ? bindingStack.size() : argStack.size();
+		parseFrames.push_back(frame);
+		pushExpression();
     }
 
-    std::shared_ptr<ExprAST> Parser::ParsePrimaryExpr()
+    //Operand position, after any prefix operators. A number, variable or argument-less call is
+    //returned in 'operand'; anything with nested expressions pushes a construct frame and the
+    //expression frame of its first part, leaving 'operand' invalid. Returns false on a parse error.
+    bool ExprParser::BeginOperand(ExprId &operand)
     {
-		ParserLog("ParsePrimaryExpr");
-        if (m_curToken.tok == lexer::tok_identifier)
-            return ParseIdentifierExpr();
-        else if (m_curToken.tok == lexer::tok_number)
-            return ParseNumberExpr();
-        else if ((m_curToken.tok == lexer::tok_unknown) && (m_curToken.unknownChar == '('))
-            return ParseParenExpr();
-		else if (m_curToken.tok == lexer::tok_if)
-			return ParseIfExpr();
-		else if (m_curToken.tok == lexer::tok_then)
-			return ParseIfExpr();
-		else if (m_curToken.tok == lexer::tok_else)
-			return ParseIfExpr();
-		else if (m_curToken.tok == lexer::tok_for)
-			return ParseForExprAST();
-		else if (m_curToken.tok == lexer::tok_var)
-			return ParseVarExprAST();
+		KTRACE(traceParser, traceDebug, "BeginOperand");
+        if (m_curToken.tok == lexer::tok_identifier) {
+			SymbolId idName = m_curToken.identId;
+			getNextToken();
+			if (m_curToken.unknownChar != '(') {
+				KTRACE(traceParser, traceDebug, "Parse identifierExpr '(' not found return VariableExprAST ");
+				operand = CreateVariable(idName);
+				return true;
+			}
+			KTRACE(traceParser, traceDebug, "Parse identifierExpr found '(' parsing callExpr ");
+			getNextToken();
+			if (m_curToken.unknownChar == ')') {
+				getNextToken(); //consume ')'
+				operand = ast.create<CallExprAST>(idName, ListRange());
+				return true;
+			}
+			pushConstruct(ParseFrame::frameCall, idName);
+			return true;
+		}
+        else if (m_curToken.tok == lexer::tok_number) {
+            operand = ParseNumberExpr();
+			return true;
+		}
+        else if ((m_curToken.tok == lexer::tok_unknown) && (m_curToken.unknownChar == '(')) {
+			getNextToken();
+			pushConstruct(ParseFrame::frameParen);
+			return true;
+		}
+		else if (m_curToken.tok == lexer::tok_if || m_curToken.tok == lexer::tok_then || m_curToken.tok == lexer::tok_else) {
+			KTRACE(traceParser, traceDebug, "ParseIfExpr");
+			getNextToken();
+			//if condition doesnt have brackets
+			pushConstruct(ParseFrame::frameIf);
+			return true;
+		}
+		else if (m_curToken.tok == lexer::tok_for) {
+			KTRACE(traceParser, traceDebug, "In ParseForExprAST");
+			getNextToken();
+			
+			if (m_curToken.tok != lexer::tok_identifier)
+				KTRACE(traceParser, traceError, "Expected identifier after 'for' ", "line", m_curToken.line, "col", m_curToken.column);
+			
+			SymbolId idName = m_curToken.identId;
+			
+			getNextToken();
+			
+			if (m_curToken.unknownChar != '=')
+				KTRACE(traceParser, traceError, "Expected '=' after for", "line", m_curToken.line, "col", m_curToken.column);
+			
+			getNextToken();
+			pushConstruct(ParseFrame::frameFor, idName);
+			return true;
+		}
+		else if (m_curToken.tok == lexer::tok_var) {
+			KTRACE(traceParser, traceDebug, "In ParseVarExprAST");
+			getNextToken();
+			
+			if (m_curToken.tok != lexer::tok_identifier) {
+				KTRACE(traceParser, traceError, "Expected identifier in var expression", "line", m_curToken.line, "col", m_curToken.column);
+				return false;
+			}
+			parseFrames.push_back(ParseFrame(ParseFrame::frameVar));
+			parseFrames.back().listBase = bindingStack.size();
+			return ContinueVarExpr();
+		}
         else {
-            ParserLog("Unknown type of expression");
-            return nullptr;
+            KTRACE(traceParser, traceError, "Unknown type of expression", "line", m_curToken.line, "col", m_curToken.column);
+            return false;
         }
     }
-    
-    bool Parser::isBinaryOperator(tokStruct curToken)
+
+    //The var frame is on top and the current token is the name of its next binding:
+    //  name [= init] (, name [= init])* in body
+    //Pushes the expression frame of the next initializer or of the body.
+    bool ExprParser::ContinueVarExpr()
     {
-		if (curToken.tok != lexer::tok_unknown)
-			return false;
-		std::string msg = "curToken.unknownChar ";
-		msg += curToken.unknownChar;
-		ParserLog(msg);
-		if ((curToken.unknownChar == '&') || (curToken.unknownChar == '|') || (curToken.unknownChar == '>') || (curToken.unknownChar == '<') || (curToken.unknownChar == '+') || (curToken.unknownChar == '-') || (curToken.unknownChar == '*') || (curToken.unknownChar == '/') || (curToken.unknownChar == '=') || (curToken.unknownChar == ':'))
-            return true;
-        return false;
+		while(1) {
+			SymbolId Name = m_curToken.identId;
+			getNextToken();
+			
+			if (m_curToken.unknownChar == '=') {
+				getNextToken();
+				parseFrames.back().name = Name;
+				parseFrames.back().stage = 0;
+				pushExpression();
+				return true;
+			}
+			bindingStack.push_back({Name, ExprId()});
+			
+			bool more;
+			if (!EndVarBinding(more))
+				return false;
+			if (!more)
+				return true;
+		}
     }
 
-    int Parser::getTokPrecedence(tokStruct curToken)
+    //After a binding of the var frame on top: consumes ',' and sets 'more' if another name follows,
+    //otherwise consumes 'in' and pushes the expression frame of the body
+    bool ExprParser::EndVarBinding(bool &more)
     {
-        //check if it is a binary operator
-		
-        if (!isBinaryOperator(curToken))
-		{
-		
-			ParserLog("Not a binary operator");
-            return -1;
+		more = false;
+		if (m_curToken.unknownChar == ',') {
+			getNextToken();
+			if (m_curToken.tok != lexer::tok_identifier) {
+				KTRACE(traceParser, traceError, "Expected identifier in var expression", "line", m_curToken.line, "col", m_curToken.column);
+				return false;
+			}
+			more = true;
+			return true;
 		}
-		
-        int TokPrec = BinopPrecedence[curToken.unknownChar];
-		
-		
-        if (TokPrec <= 0)
-            return -1;
-
-        return TokPrec;
+		if (m_curToken.tok != lexer::tok_in) {
+			KTRACE(traceParser, traceError, "Error: Expected 'in' in var expression", "line", m_curToken.line, "col", m_curToken.column);
+			return false;
+		}
+			
+		getNextToken();
+		parseFrames.back().stage = 1;
+		pushExpression();
+		return true;
     }
 
-    std::shared_ptr<ExprAST> Parser::ParseExpression()
+    //The construct frame on top has just had one of its parts parsed into 'result'. Either starts the
+    //next part or, when the construct is complete, pops its frame and returns it in 'operand'.
+    bool ExprParser::ResumeConstruct(ExprId result, ExprId &operand)
     {
-		ParserLog("ParseExpression");
-		//getNextToken();
-        auto LHS = ParsePrimaryExpr();
-        if (!LHS)
-            return nullptr;
+		ParseFrame &frame = parseFrames.back();
+		switch (frame.kind) {
+			case ParseFrame::frameParen:
+				if (m_curToken.unknownChar != ')')
+				{
+					KTRACE(traceParser, traceError, "expected ')'", "line", m_curToken.line, "col", m_curToken.column);
+					return false;
+				}
+				getNextToken(); //consume ')'
+				operand = result;
+				break;
+
+			case ParseFrame::frameCall:
+				KTRACE(traceParser, traceDebug, "ParseIdentifierExpr Parsed one argument");
+				argStack.push_back(result);
+				if (m_curToken.unknownChar == ',') {
+					getNextToken(); //consume ','
+					pushExpression();
+					return true;
+				}
+				if (m_curToken.unknownChar != ')') {
+					KTRACE(traceParser, traceError, "Expected ')' or ',' in argument list", "line", m_curToken.line, "col", m_curToken.column);
+					return false;
+				}
+				getNextToken(); //consume ')'
+				operand = ast.create<CallExprAST>(frame.name, ast.addExprList(argStack.data() + frame.listBase, argStack.size() - frame.listBase));
+				argStack.resize(frame.listBase);
+				break;
 
-        return ParseBinOpRHS(0, LHS);
+			case ParseFrame::frameIf:
+				if (frame.stage == 0) {
+					KTRACE(traceParser, traceDebug, "ParseIfExpr Parsed Cond");
+					if (m_curToken.tok != lexer::tok_then) {
+						KTRACE(traceParser, traceError, "Expected then after if statement", "line", m_curToken.line, "col", m_curToken.column);
+						return false;
+					}
+					getNextToken(); //consume 'then' expr
+				}
+				else if (frame.stage == 1) {
+					KTRACE(traceParser, traceDebug, "ParseIfExpr Parsed Then");
+					if (m_curToken.tok != lexer::tok_else)
+						KTRACE(traceParser, traceError, "Expected else after then statement", "line", m_curToken.line, "col", m_curToken.column);
+					getNextToken();  //consume 'else'
+				}
+				else {
+					KTRACE(traceParser, traceDebug, "ParseIfExpr Parsed Else");
+					operand = ast.create<IfExprAST>(frame.parts[0], frame.parts[1], result);
+					break;
+				}
+				frame.parts[frame.stage++] = result;
+				pushExpression();
+				return true;
+
+			case ParseFrame::frameFor:
+				if (frame.stage == 0 || frame.stage == 1) {
+					if (m_curToken.unknownChar != ',')
+						KTRACE(traceParser, traceError, frame.stage == 0 ? "Expected ',' after start value in for statement" : "Expected ',' after end value in for statement",
+							   "line", m_curToken.line, "col", m_curToken.column);
+					getNextToken();
+				}
+				else if (frame.stage == 2) {
+					if (m_curToken.tok != lexer::tok_in)
+						KTRACE(traceParser, traceError, "Expected 'in' after Step in for statement", "line", m_curToken.line, "col", m_curToken.column);
+					getNextToken();
+				}
+				else {
+					operand = ast.create<ForExprAST>(frame.name, frame.parts[0], frame.parts[1], frame.parts[2], result);
+					break;
+				}
+				frame.parts[frame.stage++] = result;
+				pushExpression();
+				return true;
+
+			case ParseFrame::frameVar:
+				if (frame.stage == 0) {
+					//initializer of frame.name
+					bindingStack.push_back({frame.name, result});
+					bool more;
+					if (!EndVarBinding(more))
+						return false;
+					return more ? ContinueVarExpr() : true;
+				}
+				operand = ast.create<VarExprAST>(ast.addVarBindings(bindingStack.data() + frame.listBase, bindingStack.size() - frame.listBase), result);
+				bindingStack.resize(frame.listBase);
+				break;
+
+			default:
+				return false;
+		}
+		parseFrames.pop_back();
+		return true;
     }
 
-    std::shared_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec, std::shared_ptr<ExprAST> LHS)
+    //Operator precedence parse driven by the operator table, with every nested construct
+    //(parentheses, call arguments, if/for/var) handled in the same loop: unfinished expressions and
+    //constructs are ParseFrames on an explicit stack, operands and pending operators live on
+    //operandStack/operatorStack, so nesting depth is limited by heap memory rather than the native
+    //stack.
+    ExprId ExprParser::ParseExpression()
     {
-		ParserLog("ParseBinOpRHS");
-        while(1)
-        {
-                        
-			std::string msg = "ParseBinOpRHS nextToken.unknownChar";
-			msg += m_curToken.unknownChar;
-			ParserLog(msg);
-            int tokPrec = getTokPrecedence(m_curToken);
-			msg = "Precedence ";
-			msg += std::to_string(tokPrec);
-			ParserLog(msg);
-            if (tokPrec < ExprPrec) {
-                ParserLog("returning LHS from ParseBinOpRHS");
-				return LHS;
+		KTRACE(traceParser, traceDebug, "ParseExpression");
+		size_t frameBase = parseFrames.size();
+		size_t operandBase = operandStack.size();
+		size_t operatorBase = operatorStack.size();
+		size_t argBase = argStack.size();
+		size_t bindingBase = bindingStack.size();
+
+		pushExpression();
+		bool failed = false;
+		while (!failed) {
+			//operand position: unary operators bind tighter than any binary operator
+			size_t length;
+			OperatorId op;
+			while ((op = peekOperator(length)) && operators.info(op).unary) {
+				KTRACE(traceParser, traceDebug, "unary operator", "op", operators.spelling(op));
+				operatorStack.push_back(op);
+				parseFrames.back().unaryCount++;
+				consumeOperator(length);
 			}
-            char binOp = m_curToken.unknownChar;
 
-            getNextToken(); //get expression after operator            
+			ExprId operand;
+			if (!BeginOperand(operand)) {
+				failed = true;
+				break;
+			}
 
-            auto RHS = ParsePrimaryExpr();
-            if (!RHS)
-                return nullptr;
+			//an operand is complete; finish every expression and construct it completes
+			while (operand) {
+				ParseFrame &expr = parseFrames.back();
+				for (; expr.unaryCount; expr.unaryCount--) {
+					operand = ast.create<UnaryExprAST>(operatorStack.back(), operand);
+					operatorStack.pop_back();
+				}
+				operandStack.push_back(operand);
+
+				op = peekOperator(length);
+				int prec = op ? operators.precedence(op) : -1;
+				bool rightAssoc = op && operators.info(op).rightAssoc;
+
+				//fold every pending operator that binds at least as tightly as the next one
+				while (operatorStack.size() > expr.operatorBase) {
+					int topPrec = operators.precedence(operatorStack.back());
+					if (topPrec < prec || (topPrec == prec && rightAssoc))
+						break;
+					auto RHS = operandStack.back();
+					operandStack.pop_back();
+					auto LHS = operandStack.back();
+					operandStack.back() = CreateBinary(operatorStack.back(), LHS, RHS);
+					operatorStack.pop_back();
+				}
 
-            int nextPrec = getTokPrecedence(m_curToken); //get the operator after the next expression
-			msg = "nextToken precedence";
-			msg += nextPrec;
-			ParserLog(msg);
-            if (nextPrec >= tokPrec)
-            {
-                RHS = ParseBinOpRHS(tokPrec+1, RHS);
+				if (prec >= 0) {
+					KTRACE(traceParser, traceDebug, "binary operator", "op", operators.spelling(op), "precedence", prec);
+					operatorStack.push_back(op);
+					consumeOperator(length);
+					break;
+				}
 
-                if (!RHS)
-                    return nullptr;
-            }
-			
-            LHS = make_shared<BinaryExprAST>(binOp, LHS, RHS);
+				//this expression is done
+				ExprId result = operandStack.back();
+				operandStack.pop_back();
+				parseFrames.pop_back();
+				if (parseFrames.size() == frameBase)
+					return result;
 
-        }
+				operand = ExprId();
+				if (!ResumeConstruct(result, operand)) {
+					failed = true;
+					break;
+				}
+			}
+		}
+
+		parseFrames.resize(frameBase);
+		operandStack.resize(operandBase);
+		operatorStack.resize(operatorBase);
+		argStack.resize(argBase);
+		bindingStack.resize(bindingBase);
+		return ExprId();
     }
 
-    std::shared_ptr<PrototypeAST> Parser::ParsePrototype()
+    //  name(args)
+    //  binary<op> [precedence] (lhs, rhs)
+    //  unary<op> (operand)
+    //An operator is usable in expressions as soon as its prototype has been parsed.
+    ExprId ExprParser::ParsePrototype()
     {
-		std::cout << "ParsePrototype " << std::endl << std::flush;
+		KTRACE(traceParser, traceDebug, "ParsePrototype");
         if (m_curToken.tok != lexer::tok_identifier) {
-            ParserLog("Expected function name in prototype");
-            return nullptr;
+            KTRACE(traceParser, traceError, "Expected function name in prototype", "line", m_curToken.line, "col", m_curToken.column);
+            return ExprId();
         }
 
-        std::string fnName = m_curToken.identifierStr;
+        SymbolId fnName = m_curToken.identId;
+        std::string_view kind = m_curToken.identifierStr;
+        //0 for a plain function, otherwise the number of operands of the operator being defined
+        unsigned operatorArity = 0;
+        OperatorId op = 0;
+        int precedence = 30;
         getNextToken();
+
+        //'def fast f(x)' / 'def strict f(x)', while 'def fast(x)' defines a function named fast
+        FloatMode mode = floatDefault;
+        if ((kind == "fast" || kind == "strict") && m_curToken.tok == lexer::tok_identifier) {
+            mode = kind == "fast" ? floatFast : floatStrict;
+            fnName = m_curToken.identId;
+            kind = m_curToken.identifierStr;
+            getNextToken();
+        }
+
+        if ((kind == "binary" || kind == "unary") && m_curToken.tok == lexer::tok_unknown && isOperatorChar(m_curToken.unknownChar)) {
+            operatorArity = kind == "binary" ? 2 : 1;
+            std::string spelling(1, m_curToken.unknownChar);
+            tokStruct prev = m_curToken;
+            getNextToken();
+            while (m_curToken.tok == lexer::tok_unknown && isOperatorChar(m_curToken.unknownChar) && adjacent(prev, m_curToken)) {
+                spelling += m_curToken.unknownChar;
+                prev = m_curToken;
+                getNextToken();
+            }
+
+            if (operatorArity == 2 && m_curToken.tok == lexer::tok_number) {
+                precedence = (int)m_curToken.numVal;
+                if (precedence < 1 || precedence > 100) {
+                    KTRACE(traceParser, traceError, "Invalid precedence: must be 1..100", "line", m_curToken.line, "col", m_curToken.column);
+                    return ExprId();
+                }
+                getNextToken();
+            }
+
+            op = operators.declare(spelling);
+            if (!op) {
+                KTRACE(traceParser, traceError, "Too many operators declared", "op", spelling);
+                return ExprId();
+            }
+            if (operatorArity == 2 && operators.info(op).builtin) {
+                KTRACE(traceParser, traceError, "Cannot redefine builtin operator", "op", spelling);
+                return ExprId();
+            }
+            fnName = internName(std::string(kind) + spelling);
+            if (fnName == StringInterner::NotInterned) {
+                KTRACE(traceParser, traceError, "Operator was not declared before parsing", "op", spelling);
+                return ExprId();
+            }
+        }
+
         if (m_curToken.unknownChar != '(') {
-            ParserLog("Expected '(' in prototype");
-			std::cout << m_curToken.unknownChar << std::endl;
-            return nullptr;
+            KTRACE(traceParser, traceError, "Expected '(' in prototype", "line", m_curToken.line, "col", m_curToken.column);
+            return ExprId();
         }
 
-        std::vector<std::string> ArgNames;
+        std::vector<SymbolId> ArgNames;
         getNextToken();
         while ((m_curToken.tok == lexer::tok_identifier) || (m_curToken.unknownChar == ','))
         {
 			if (m_curToken.tok == lexer::tok_identifier) {
-				ArgNames.push_back(m_curToken.identifierStr);
+				ArgNames.push_back(m_curToken.identId);
 			}
             getNextToken();
         }
 
         if (m_curToken.unknownChar != ')')
-            ParserLog("Expected ')' in prototype");
+            KTRACE(traceParser, traceError, "Expected ')' in prototype", "line", m_curToken.line, "col", m_curToken.column);
 		
 		getNextToken();
 
-        return make_shared<PrototypeAST>(fnName, ArgNames);
+        if (operatorArity && ArgNames.size() != operatorArity) {
+            KTRACE(traceParser, traceError, "Invalid number of operands for operator", "name", symbols.str(fnName));
+            return ExprId();
+        }
+        if (operatorArity == 2)
+            operators.defineBinary(op, precedence, fnName);
+        else if (operatorArity == 1)
+            operators.defineUnary(op, fnName);
+
+        ExprId proto = ast.create<PrototypeAST>(fnName, ast.addSymbolList(ArgNames));
+        ast.as<PrototypeAST>(proto)->Float = mode;
+        //the body that follows a definition's prototype is parsed in its mode
+        floatMode = mode;
+        return proto;
     }
 
-    std::shared_ptr<FunctionAST> Parser::ParseDefinition()
+    ExprId ExprParser::ParseDefinition()
     {
-        ParserLog("ParseDefinition");
+        KTRACE(traceParser, traceDebug, "ParseDefinition");
         getNextToken(); //consume 'def'
         auto proto = ParsePrototype();
         if (!proto)
-            return nullptr;
+            return ExprId();
 		
         if (auto E = ParseExpression())
-            return make_shared<FunctionAST>(proto, E);
+            return ast.create<FunctionAST>(proto, E);
 
-        return nullptr;
+        return ExprId();
     }
 	
-	std::shared_ptr<IfExprAST> Parser::ParseIfExpr()
-	{
-		ParserLog("ParseIfExpr");
-		getNextToken();
-		//if condition doesnt have brackets
-		auto Cond = ParseExpression();
-		
-		ParserLog("ParseIfExpr Parsed Cond");
-		if (!Cond)
-			return nullptr;
-		
-		if (m_curToken.tok != lexer::tok_then) {
-			ParserLog("Expected then after if statement");
-			return nullptr;
-		}
-		
-		getNextToken(); //consume 'then' expr
-		
-		auto Then = ParseExpression();
-				
-		if (!Then)
-			return nullptr;
-		
-		ParserLog("ParseIfExpr Parsed Then");
-		
-		if (m_curToken.tok != lexer::tok_else)
-			ParserLog("Expected else after then statement");
-		
-		getNextToken();  //consume 'else'
-		
-		
-		auto Else = ParseExpression();
-		
-		if (!Else)
-			return nullptr;
-		
-		ParserLog("ParseIfExpr Parsed Else");
-		
-		return make_shared<IfExprAST>(Cond, Then, Else);
-		
-		
-	}
-	
-	std::shared_ptr<ForExprAST> Parser::ParseForExprAST ()
-	{
-		ParserLog("In ParseForExprAST");
-		getNextToken();
-		
-		if (m_curToken.tok != lexer::tok_identifier)
-			ParserLog("Expected identifier after 'for' ");
-		
-		std::string idName = m_curToken.identifierStr;
-		
-		getNextToken();
-		
-		if (m_curToken.unknownChar != '=')
-			ParserLog("Expected '=' after for");
-		
-		getNextToken();
-		
-		auto Start = ParseExpression();
-		if (!Start)
-			return nullptr;
-		
-		if (m_curToken.unknownChar != ',')
-			ParserLog("Expected ',' after start value in for statement");
-		getNextToken();
-		
-		auto End = ParseExpression();
-		
-		if (!End)
-			return nullptr;
-		
-		if (m_curToken.unknownChar != ',')
-			ParserLog("Expected ',' after end value in for statement");
-		getNextToken();
-		
-		
-		auto Step = ParseExpression();
-		
-		if (!Step)
-			return nullptr;
-		
-		if (m_curToken.tok != lexer::tok_in)
-			ParserLog("Expected 'in' after Step in for statement");
-		
-		getNextToken();
-		
-		auto Body = ParseExpression();
-		
-		if (!Body)
-			return nullptr;
-		
-		return make_shared<ForExprAST>(idName, Start, End, Step, Body);
-		
-	}
-	
-	std::shared_ptr<ExprAST> Parser::ParseVarExprAST()
-	{
-		ParserLog("In ParseVarExprAST");
-		std::vector<std::pair<std::string, std::shared_ptr<ExprAST>>> VarNames;
-		getNextToken();
-		
-		if (m_curToken.tok != lexer::tok_identifier) {
-			ParserLog("Expected identifier in var expression");
-			return nullptr;
-		}
-		
-		while(1) {
-			std::string Name = m_curToken.identifierStr;
-			getNextToken();
-			
-			std::shared_ptr<ExprAST> Init;
-			if (m_curToken.unknownChar == '=') {
-				getNextToken();
-				Init = ParseExpression();
-				if (!Init)
-					return nullptr;
-			}
-			VarNames.push_back(std::make_pair(Name, Init));
-			
-			if (m_curToken.unknownChar != ',')
-				break;
-			
-			getNextToken();
-			if (m_curToken.tok != lexer::tok_identifier) {
-				ParserLog("Expected identifier in var expression");
-				return nullptr;
-			}
-		}
-		if (m_curToken.tok != lexer::tok_in) {
-			ParserLog("Error: Expected 'in' in var expression");
-			return nullptr;
-		}
-			
-		getNextToken();
-		
-		auto Body = ParseExpression();
-		
-		if (!Body) 
-			return nullptr;
-		
-		return make_shared<VarExprAST>(VarNames, Body);
-	}
-
-    std::shared_ptr<PrototypeAST> Parser::ParseExtern()
+    ExprId ExprParser::ParseExtern()
     {
         getNextToken(); //consume 'extern'
         return ParsePrototype();
     }
 
-    std::shared_ptr<FunctionAST> Parser::ParseTopLevelExpr()
+    ExprId ExprParser::ParseTopLevelExpr()
     {
-		ParserLog("ParseTopLevelExpr");
+		KTRACE(traceParser, traceDebug, "ParseTopLevelExpr");
+		floatMode = floatDefault;
 		//getNextToken();
         if (auto E = ParseExpression())
         {
             //make anonymous prototype
-            auto proto = make_shared<PrototypeAST>("", std::vector<std::string>());;
-            return make_shared<FunctionAST>(proto, E);
+            auto proto = ast.create<PrototypeAST>(internName(""), ListRange(), true);
+            return ast.create<FunctionAST>(proto, E);
         }
-        return nullptr;
+        return ExprId();
     }
 
-    void Parser::HandleDefinition () {
-        ParserLog("HandleDefinition");
-        if (auto FnAST = ParseDefinition())
+    bool ExprParser::ParseNextItem(ExprId &item)
+    {
+        while (1)
         {
-			auto *FnIR = code_Gen.codegen(FnAST);
-			if (FnIR)
-			{
-				fprintf(stderr, "Parsed a function definition\n");
-				FnIR->print(errs());
-				fprintf(stderr, "\n");
-			}
+			KTRACE(traceParser, traceDebug, "ParseNextItem", "char", m_curToken.unknownChar);
+            if (m_curToken.tok == lexer::tok_eof)
+                return false;
 
-        }
-        else
-        {
-            getNextToken();
+            if (m_curToken.unknownChar == ';') {
+                getNextToken();
+                continue;
+            }
+
+            if (m_curToken.tok == lexer::tok_def)
+                item = ParseDefinition();
+            else if (m_curToken.tok == lexer::tok_extern)
+                item = ParseExtern();
+            else
+                item = ParseTopLevelExpr();
+
+            if (!item)
+                getNextToken();
+            return true;
         }
     }
 
-    void Parser::HandleExtern () {
-        if (auto ProtoAST = ParseExtern())
-        {
-			auto *FnIR = code_Gen.codegen(ProtoAST);
+	ExprParser::ExprParser(StringInterner &_symbols) : symbols(_symbols), lex(nullptr), tokens(nullptr), tokIndex(0), tokEnd(0),
+		m_curToken(tokStruct(lexer::tok_unknown)), hashCons(false) {
+	}
+
+	ExprParser::ExprParser(StringInterner &_symbols, const TokenBuffer &_tokens, const OperatorTable &_operators) : symbols(_symbols),
+		lex(nullptr), tokens(&_tokens), tokIndex(0), tokEnd(_tokens.size()), m_curToken(tokStruct(lexer::tok_unknown)), operators(_operators), hashCons(false) {
+	}
+
+	void ExprParser::setRange(size_t begin, size_t end)
+	{
+		tokIndex = begin;
+		tokEnd = end;
+		m_curToken = tokStruct(lexer::tok_unknown);
+		getNextToken();
+	}
+
+	Value* Parser::GenerateItem(ExprId item)
+	{
+		if (options.simplify)
+			simplifier.run(item);
+
+		//memoization relies on the simplifier's purity analysis
+		FunctionAST* fn = ast.asOrNull<FunctionAST>(item);
+		if (options.autoMemoize && fn) {
+			SymbolId name = ast.as<PrototypeAST>(fn->Proto)->Name;
+			if (simplifier.isPureRecursive(name))
+				code_Gen.setMemoized(name);
+		}
+
+		if (ast.get(item)->getType() == exprTypePrototype) {
+			auto *FnIR = code_Gen.codegen(item);
 			if (FnIR)
 			{
-				fprintf(stderr, "Parsed an extern\n");
-				FnIR->print(errs());
-				fprintf(stderr, "\n");
+				KTRACE(traceParser, traceInfo, "parsed extern", "name", symbols.str(ast.as<PrototypeAST>(item)->getName()));
+				if (options.echoIR)
+					EchoIR(FnIR);
 			}
+			return FnIR;
+		}
 
-        }
-        else
-        {
-            getNextToken();
-        }
-    }
+		PrototypeAST* proto = ast.as<PrototypeAST>(ast.as<FunctionAST>(item)->Proto);
+		if (proto->Anonymous)
+			KTRACE(traceParser, traceInfo, "parsed top-level expression");
 
-    void Parser::HandleTopLevelExpression () {
-		ParserLog("HandleTopLevelExpression");
-        if (auto FnAST = ParseTopLevelExpr())
-        {
-			fprintf(stderr, "Parsed a top-level expression\n");
-			
-			auto *FnIR = code_Gen.codegen(FnAST);
+		//clones the simplifier made for calls in this item; declared first since the item calls them
+		std::vector<ExprId> specializations = simplifier.takeSpecializations();
+		if (!specializations.empty() && !proto->Anonymous)
+			code_Gen.codegen(ast.as<FunctionAST>(item)->Proto);
+		for (ExprId spec : specializations)
+			code_Gen.codegen(ast.as<FunctionAST>(spec)->Proto);
 		
-			if (FnIR)
-			{
-				FnIR->print(errs());
-				fprintf(stderr, "\n");
-			}
-        }
-        else
-        {
-            getNextToken();
-        }
-    }
+		auto *FnIR = code_Gen.codegen(item);
+		if (FnIR)
+		{
+			if (!proto->Anonymous)
+				KTRACE(traceParser, traceInfo, "parsed function definition", "name", symbols.str(proto->getName()));
+			if (options.echoIR)
+				EchoIR(FnIR);
+		}
+
+		//the clones go right before the item, whether or not it was declared earlier
+		for (ExprId spec : specializations) {
+			Value* SpecIR = code_Gen.codegen(spec);
+			if (!SpecIR)
+				continue;
+			KTRACE(traceParser, traceInfo, "generated specialization", "name", symbols.str(ast.as<PrototypeAST>(ast.as<FunctionAST>(spec)->Proto)->getName()));
+			if (options.echoIR)
+				EchoIR(SpecIR);
+			code_Gen.moveToEnd(cast<Function>(SpecIR));
+		}
+		if (FnIR && !specializations.empty())
+			code_Gen.moveToEnd(cast<Function>(FnIR));
+		return FnIR;
+	}
 
     void Parser::MainLoop()
     {
-        getNextToken();
-        while(1)
-        {
-			std::string msg = "MainLoop m_curToken.unknownChar:";
-			msg += m_curToken.unknownChar;
-			ParserLog(msg);
-            if (m_curToken.tok == lexer::tok_eof)
-                return;
+		if (options.jobs > 1)
+			ParallelMainLoop();
+		else {
+			getNextToken();
+			ExprId item;
+			while (ParseNextItem(item))
+			{
+				if (item)
+					GenerateItem(item);
+			}
+		}
 
-            else if (m_curToken.unknownChar == ';') {
-                getNextToken();
-            }
-            else if (m_curToken.tok == lexer::tok_def) {
-                HandleDefinition();
-				ParserLog("done with HandleDefinition");
-				getNextToken();
-                
-            }
-            else if (m_curToken.tok == lexer::tok_extern) {
-                HandleExtern();
-				ParserLog("done with HandleExtern" );
-				getNextToken();
-            }
-            else {
-                HandleTopLevelExpression();
-                ParserLog("done with HandleTopLevelExpression");
-				getNextToken();
-            }
-        }
+		if (hashCons)
+			KTRACE(traceParser, traceInfo, "hash-consing", "nodes", ast.size(), "shared", sharedNodes() + workerShared,
+				   "reused values", code_Gen.reusedValues);
+		if (options.simplify)
+			KTRACE(tracePass, traceInfo, "simplify", "folded", simplifier.constantsFolded, "identities", simplifier.identitiesApplied,
+				   "branches", simplifier.branchesPruned, "loops", simplifier.loopsPruned, "pure functions", simplifier.functionsPure,
+				   "calls evaluated", simplifier.callsEvaluated, "calls not evaluated", simplifier.callsNotEvaluated,
+				   "functions specialized", simplifier.functionsSpecialized, "calls specialized", simplifier.callsSpecialized);
+
+		if (stats::enabled()) {
+			stats::add("ast.nodes", ast.size());
+			if (hashCons) {
+				stats::add("hash-cons.shared-nodes", sharedNodes() + workerShared);
+				stats::add("hash-cons.reused-values", code_Gen.reusedValues);
+			}
+			if (options.simplify) {
+				stats::add("simplify.nodes-before", simplifier.nodesBefore);
+				stats::add("simplify.nodes-after", simplifier.nodesAfter);
+				stats::add("simplify.constants-folded", simplifier.constantsFolded);
+				stats::add("simplify.identities", simplifier.identitiesApplied);
+				stats::add("simplify.branches-pruned", simplifier.branchesPruned);
+				stats::add("simplify.loops-pruned", simplifier.loopsPruned);
+				stats::add("simplify.pure-functions", simplifier.functionsPure);
+				stats::add("eval.calls-evaluated", simplifier.callsEvaluated);
+				stats::add("eval.calls-not-evaluated", simplifier.callsNotEvaluated);
+				stats::add("eval.steps", simplifier.evalSteps());
+				stats::add("specialize.functions", simplifier.functionsSpecialized);
+				stats::add("specialize.calls", simplifier.callsSpecialized);
+				stats::add("specialize.nodes-cloned", simplifier.nodesCloned);
+			}
+			if (options.autoMemoize)
+				stats::add("memoize.functions", code_Gen.memoBodies.size());
+			stats::add("codegen.tail-calls", code_Gen.tailCallsMarked);
+			stats::add("codegen.tail-calls-looped", code_Gen.tailCallsLooped);
+			stats::add("codegen.accumulator-sites", code_Gen.accumulatorSites);
+			stats::add("codegen.if-selects", code_Gen.selectsEmitted);
+			if (options.fpContract == fpContractOn)
+				stats::add("codegen.fused-mul-adds", code_Gen.mulAddsFused);
+			if (options.directSSA)
+				stats::add("codegen.ssa-variables", code_Gen.ssaVariables);
+			if (options.inferIntegers) {
+				stats::add("infer.integer-loops", code_Gen.integers.loopsInferred);
+				stats::add("infer.integer-counters", code_Gen.integers.countersInferred);
+			}
+		}
     }
-	
-	Parser::Parser(char* fileName, bool _printLog):lex(lexer(fileName, printLog)),m_curToken(tokStruct(lexer::tok_unknown)), printLog(_printLog) , code_Gen(Code_Gen(_printLog)){
-	BinopPrecedence = 
+
+	//Top-level items start at every 'def' and 'extern'. The token buffer is cut at those points into
+	//ranges, ranges are grouped into fixed-size batches and the batches are parsed on 'jobs' threads,
+	//each into its own ASTContext with its diagnostics captured. The batches are then merged into 'ast'
+	//in source order, every prototype is declared, and code is generated serially, so the output and
+	//the diagnostics are the same for any number of threads.
+	//
+	//Operators change how later items parse, so items declaring operators have their prototypes
+	//parsed first; in this mode an operator is usable anywhere in the file.
+	void Parser::ParallelMainLoop()
 	{
-		{':' ,  1},
-		{'=' ,  2},
-		{'<' , 10},
-		{'>' , 11},
-		{'+' , 20},
-		{'-' , 30},
-		{'*' , 40},
-	};
-	//Code_Gen code_Gen(_printLog);
+		static const size_t RangesPerBatch = 64;
+		auto start = std::chrono::steady_clock::now();
+
+		std::vector<size_t> rangeStarts;
+		rangeStarts.push_back(0);
+		for (size_t i = 0; i < prelexed.size(); i++) {
+			lexer::Token kind = (lexer::Token)prelexed.kinds[i];
+			if ((kind == lexer::tok_def || kind == lexer::tok_extern) && i != 0)
+				rangeStarts.push_back(i);
+		}
+		size_t rangeCount = rangeStarts.size();
+		rangeStarts.push_back(prelexed.size());
+
+		//operator declarations, in source order; this also interns every name workers will look up
+		for (size_t r = 0; r < rangeCount; r++) {
+			size_t first = rangeStarts[r];
+			auto identifierAt = [&](size_t i) {
+				return i < prelexed.size() && prelexed.kinds[i] == lexer::tok_identifier ? identifiers.str(prelexed.values[i]) : std::string_view();
+			};
+			//'def fast binary% ...', 'def strict unary- ...'
+			size_t at = first + 1;
+			if ((identifierAt(at) == "fast" || identifierAt(at) == "strict") && !identifierAt(at + 1).empty())
+				at++;
+			if (identifierAt(at) != "binary" && identifierAt(at) != "unary")
+				continue;
+			setRange(first + 1, rangeStarts[r + 1]);
+			ParsePrototype();
+		}
+		ast.clear();
+		shared.clear();
+
+		struct Batch {
+			ExprParser* parser = nullptr;
+			std::vector<ExprId> items;
+			std::string diagnostics;
+		};
+		std::vector<Batch> batches((rangeCount + RangesPerBatch - 1) / RangesPerBatch);
+		std::vector<std::unique_ptr<ExprParser>> parsers;
+		for (size_t b = 0; b < batches.size(); b++) {
+			parsers.emplace_back(new ExprParser(identifiers, prelexed, operators));
+			parsers.back()->setHashCons(options.hashCons);
+			parsers.back()->setSymbolsReadOnly(true);
+			batches[b].parser = parsers.back().get();
+		}
+
+		std::atomic<size_t> nextBatch(0);
+		auto worker = [&]() {
+			while (1) {
+				size_t b = nextBatch++;
+				if (b >= batches.size())
+					return;
+				Batch &batch = batches[b];
+				trace::captureBuffer = &batch.diagnostics;
+				size_t last = std::min(rangeCount, (b + 1) * RangesPerBatch);
+				for (size_t r = b * RangesPerBatch; r < last; r++) {
+					batch.parser->setRange(rangeStarts[r], rangeStarts[r + 1]);
+					ExprId item;
+					while (batch.parser->ParseNextItem(item))
+						if (item)
+							batch.items.push_back(item);
+				}
+				trace::captureBuffer = nullptr;
+			}
+		};
+		std::vector<std::thread> threads;
+		for (unsigned t = 1; t < options.jobs; t++)
+			threads.emplace_back(worker);
+		worker();
+		for (std::thread &t : threads)
+			t.join();
+
+		std::vector<ExprId> items;
+		for (Batch &batch : batches) {
+			trace::flush(batch.diagnostics);
+			uint32_t base = ast.absorb(batch.parser->ast);
+			for (ExprId item : batch.items)
+				items.push_back(ExprId(item.index + base));
+			workerShared += batch.parser->sharedNodes();
+		}
+		parsers.clear();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		KTRACE(traceParser, traceInfo, "parallel parse", "items", items.size(), "ranges", rangeCount, "threads", options.jobs,
+			   "seconds", elapsed.count());
+
+		//every function is declared before any body is generated, so definitions can call ahead
+		for (ExprId item : items) {
+			ExprId proto = ast.get(item)->getType() == exprTypeFunc ? ast.as<FunctionAST>(item)->Proto : item;
+			if (!ast.as<PrototypeAST>(proto)->Anonymous)
+				code_Gen.codegen(proto);
+		}
+
+		//a function is moved to the end of the module when it is first generated, which puts
+		//functions in the same order as a serial parse
+		std::unordered_set<Value*> placed;
+		for (ExprId item : items) {
+			Value* FnIR = GenerateItem(item);
+			if (FnIR && placed.insert(FnIR).second)
+				code_Gen.moveToEnd(cast<Function>(FnIR));
+		}
+	}
+
+	Parser::Parser(char* fileName, const CompileOptions &_options) : ExprParser(identifiers), source(fileName, identifiers),
+		options(_options), workerShared(0), simplifier(ast, identifiers, operators, options.evalSteps, options.specializeBudget,
+		(options.fpFlags & fpSimplifyFlags) == fpSimplifyFlags), code_Gen(identifiers, ast, operators){
+	hashCons = options.hashCons;
+	code_Gen.tailAccumulate = options.tailAccumulate;
+	code_Gen.inferIntegers = options.inferIntegers;
+	code_Gen.selectIf = options.selectIf;
+	code_Gen.directSSA = options.directSSA;
+	code_Gen.optLevel = options.optLevel;
+	code_Gen.optSize = options.optSize;
+	code_Gen.forceIsaLevel = options.forceIsaLevel;
+	code_Gen.fpFlags = options.fpFlags;
+	code_Gen.fpContract = options.fpContract;
+	if (!options.cpu.empty() || !options.features.empty())
+		code_Gen.setTarget(options.cpu, options.features);
+	code_Gen.memoEntries = 1;
+	while (code_Gen.memoEntries < options.memoEntries && code_Gen.memoEntries < (1u << 30))
+		code_Gen.memoEntries *= 2;
+	if (options.prelex || options.jobs > 1) {
+		prelexed.lexAll(source, identifiers);
+		tokens = &prelexed;
+		tokEnd = prelexed.size();
+	}
+	else
+		lex = &source;
+	//name of every anonymous prototype
+	identifiers.intern("");
     }
 	
-	void Parser::ParserLog(std::string str) 
+	void Parser::EchoIR(Value* FnIR)
 	{
-		if (printLog) 
-		{
-			std::cout << "Parser " << str << std::endl;
-		}
+		FnIR->print(errs());
+		fprintf(stderr, "\n");
 	}
 
 
@@ -9,8 +9,15 @@
 #include <fstream>
 #include <utility>
 #include <iostream>
+#include <deque>
+#include <thread>
 
 #include "Lexer.h"
+#include "TokenBuffer.h"
+#include "Operators.h"
+#include "HashCons.h"
+#include "Options.h"
+#include "Simplify.h"
 
 #ifndef AST_DEFINED
 #include "AST.h"
@@ -29,58 +36,171 @@ namespace myCompiler {
 
 typedef lexer::tokStruct tokStruct;
 
-class Parser {
+//Something ParseExpression has started but not finished. An expression frame owns the entries of
+//operandStack/operatorStack above its bases; a construct frame (parentheses, call, if, for, var) sits
+//right below the expression frame of the part it is waiting for.
+struct ParseFrame {
+	enum Kind : uint8_t { frameExpr, frameParen, frameCall, frameIf, frameFor, frameVar };
+
+	Kind kind;
+	//part of an if/for being parsed; for a var, 0 while in an initializer and 1 in the body
+	uint8_t stage = 0;
+	//frameExpr: prefix operators on operatorStack waiting for the operand
+	uint32_t unaryCount = 0;
+	uint32_t operandBase = 0;
+	uint32_t operatorBase = 0;
+	//frameCall/frameVar: first entry in argStack/bindingStack
+	uint32_t listBase = 0;
+	//callee, loop variable, or variable whose initializer is being parsed
+	SymbolId name = 0;
+	//parts parsed so far: if (cond, then), for (start, end, step)
+	ExprId parts[3];
+
+	ParseFrame(Kind _kind = frameExpr) : kind(_kind) {}
+};
 
-    private:
+//Parser over one token stream. Nodes go into its own ASTContext. Identifiers are
+//interned by the lexer before parsing, so several ExprParsers can share one TokenBuffer and
+//StringInterner across threads (see Parser::ParallelMainLoop).
+class ExprParser {
+
+    protected:
+
+	//identifier spellings for every SymbolId in the AST; outlives lexing so codegen can name values
+	StringInterner &symbols;
 	
-	lexer lex;
+	//token source: 'lex' when streaming, with 'lookahead' holding any peeked tokens; otherwise
+	//tokens [tokIndex, tokEnd) of a prelexed 'tokens' buffer, read as eof past tokEnd
+	lexer* lex;
+	const TokenBuffer* tokens;
+	size_t tokIndex;
+	size_t tokEnd;
+	std::deque<tokStruct> lookahead;
 	
     tokStruct m_curToken;
-	bool printLog;
 
-    std::map<char, int> BinopPrecedence;
+	//precedence/associativity of every operator, builtin and declared
+    OperatorTable operators;
+
+	//state of the expression being parsed, see ParseExpression
+	std::vector<ParseFrame> parseFrames;
+	std::vector<ExprId> operandStack;
+	std::vector<OperatorId> operatorStack;
+	//arguments of unfinished calls, bindings of unfinished var expressions
+	std::vector<ExprId> argStack;
+	std::vector<VarBinding> bindingStack;
+
+	//--hash-cons: identical side-effect-free subtrees are built once
+	bool hashCons;
+	HashConsTable shared;
+	//of the definition being parsed, part of the key of shared operators
+	FloatMode floatMode = floatDefault;
+
+	bool symbolsReadOnly = false;
+
+	//id of a name the parser makes up (operator functions, anonymous prototypes); NotInterned when
+	//the symbols are read-only and nobody interned it
+	SymbolId internName(std::string_view name)
+	{
+		return symbolsReadOnly ? symbols.find(name) : symbols.intern(name);
+	}
 	
     
     //sets member 'nextToken' so the next token is visible to the main loop when getNextToken is called by one of the 'ParseIdentifierExpr' type functions
     tokStruct getNextToken();
-	
 
-    std::shared_ptr<ExprAST> ParseNumberExpr();
+	//n-th token after the current one, without consuming anything
+	tokStruct peekToken(size_t n = 1);
+
 
-    //called when current token is '('
-    std::shared_ptr<ExprAST> ParseParenExpr();
+    ExprId ParseNumberExpr();
 
-    std::shared_ptr<ExprAST> ParseIdentifierExpr();
+	//node constructors that go through 'shared' when hash-consing
+	ExprId CreateVariable(SymbolId name);
 
-    std::shared_ptr<ExprAST> ParsePrimaryExpr();
+	ExprId CreateBinary(OperatorId op, ExprId LHS, ExprId RHS);
     
-    bool isBinaryOperator (tokStruct curToken);
+	static bool adjacent(const tokStruct &first, const tokStruct &second);
 
-    int getTokPrecedence(tokStruct curToken);
+	//operator spelled by the current token and any operator characters directly after it, 0 if none;
+	//'length' is the number of tokens it spans
+	OperatorId peekOperator(size_t &length);
 
-    std::shared_ptr<ExprAST> ParseExpression();
+	void consumeOperator(size_t length);
 
-    std::shared_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::shared_ptr<ExprAST> LHS);
-	
-    std::shared_ptr<PrototypeAST> ParsePrototype();
+	void pushExpression();
+
+	//construct frame followed by the expression frame of its first part
+	void pushConstruct(ParseFrame::Kind kind, SymbolId name = 0);
+
+	bool BeginOperand(ExprId &operand);
+
+	bool ResumeConstruct(ExprId result, ExprId &operand);
+
+	bool ContinueVarExpr();
+
+	bool EndVarBinding(bool &more);
+
+    ExprId ParseExpression();
 
-    std::shared_ptr<FunctionAST> ParseDefinition();
-	
-	std::shared_ptr<IfExprAST> ParseIfExpr();
 	
-	std::shared_ptr<ForExprAST> ParseForExprAST ();
+    ExprId ParsePrototype();
+
+    ExprId ParseDefinition();
 	
-	std::shared_ptr<ExprAST> ParseVarExprAST();
+    ExprId ParseExtern();
+
+    ExprId ParseTopLevelExpr();
 
-    std::shared_ptr<PrototypeAST> ParseExtern();
+    public:
+
+	//every node parsed by this parser; Parse* functions return indices into it
+	ASTContext ast;
+
+	//streaming parser, the token source is attached by the owner
+	ExprParser(StringInterner &_symbols);
+
+	//parser over part of a prelexed buffer, starting from a copy of an operator table
+	ExprParser(StringInterner &_symbols, const TokenBuffer &_tokens, const OperatorTable &_operators);
+
+	//restrict a prelexed parser to tokens [begin, end)
+	void setRange(size_t begin, size_t end);
+
+	void setHashCons(bool enable) { hashCons = enable; }
+
+	//parallel workers share the interner: they only look names up, the pre-pass interned them all
+	void setSymbolsReadOnly(bool enable) { symbolsReadOnly = enable; }
+
+	//nodes hash-consing has saved so far
+	size_t sharedNodes() const { return shared.sharedCount(); }
+
+	//Parses the next top-level item (definition, extern or expression) into 'item'. On a parse error
+	//'item' is invalid and the offending token has been skipped. Returns false at the end of input.
+	bool ParseNextItem(ExprId &item);
+};
+
+class Parser : public ExprParser {
+
+    private:
+
+	StringInterner identifiers;
+	
+	lexer source;
 
-    std::shared_ptr<FunctionAST> ParseTopLevelExpr();
+	//with prelex the whole input is lexed into 'prelexed' up front and the parser walks it by index;
+	//with jobs > 1 top-level items are parsed on that many threads
+	CompileOptions options;
+	//nodes saved by hash-consing in the worker parsers of ParallelMainLoop
+	size_t workerShared;
+	TokenBuffer prelexed;
 
-    void HandleDefinition ();
+	//runs on each item between parsing and codegen
+	Simplifier simplifier;
 
-    void HandleExtern ();
+	//codegen and diagnostics for one item produced by ParseNextItem
+	Value* GenerateItem(ExprId item);
 
-    void HandleTopLevelExpression ();
+	void ParallelMainLoop();
 
     public:
 	
@@ -88,9 +208,9 @@ class Parser {
 	
     void MainLoop();
 
-    Parser(char* fileName, bool _printLog);
+    Parser(char* fileName, const CompileOptions &_options = CompileOptions());
 	
-	void ParserLog(std::string str) ;
+	void EchoIR(Value* FnIR);
 };
 
-}
\ No newline at end of file
+}
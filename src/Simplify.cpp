@@ -0,0 +1,601 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Operators.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "Simplify.h"
+
+namespace myCompiler {
+
+	void Simplifier::setEffectFree(ExprId id, bool value)
+	{
+		if (id.index >= effectFree.size())
+			effectFree.resize(id.index + 1, 0);
+		effectFree[id.index] = value;
+	}
+
+	bool Simplifier::isNumber(ExprId id, double &val) const
+	{
+		NumberExprAST* num = ast.asOrNull<NumberExprAST>(id);
+		if (!num)
+			return false;
+		val = num->Val;
+		return true;
+	}
+
+	ExprId Simplifier::number(double val)
+	{
+		ExprId id = ast.create<NumberExprAST>(val);
+		setEffectFree(id, true);
+		return id;
+	}
+
+	size_t Simplifier::countNodes(ExprId root, std::vector<ExprId>* nodes, size_t limit)
+	{
+		if (visitedIn.size() < ast.size())
+			visitedIn.resize(ast.size(), 0);
+		visitStamp++;
+		size_t count = 0;
+		std::vector<ExprId> pending(1, root);
+		while (!pending.empty() && count < limit) {
+			ExprId id = pending.back();
+			pending.pop_back();
+			if (visitedIn[id.index] == visitStamp)
+				continue;
+			visitedIn[id.index] = visitStamp;
+			count++;
+			if (nodes)
+				nodes->push_back(id);
+			ast.forEachChild(ast.get(id), [&](ExprId &child) { pending.push_back(child); });
+		}
+		return count;
+	}
+
+	bool Simplifier::isPure(FunctionAST* fnExprAST, SymbolId self, bool &recursive)
+	{
+		uint32_t arity = ast.as<PrototypeAST>(fnExprAST->Proto)->Args.size();
+		recursive = false;
+		auto calls = [&](SymbolId callee, uint32_t args) {
+			if (callee == self) {
+				recursive = true;
+				return args == arity;
+			}
+			ExprId body = callee < pureFunctions.size() ? pureFunctions[callee] : ExprId();
+			return body && ast.as<PrototypeAST>(ast.as<FunctionAST>(body)->Proto)->Args.size() == args;
+		};
+
+		if (visitedIn.size() < ast.size())
+			visitedIn.resize(ast.size(), 0);
+		visitStamp++;
+		std::vector<ExprId> pending(1, fnExprAST->Body);
+		while (!pending.empty()) {
+			ExprId id = pending.back();
+			pending.pop_back();
+			if (visitedIn[id.index] == visitStamp)
+				continue;
+			visitedIn[id.index] = visitStamp;
+
+			ExprAST* node = ast.get(id);
+			if (CallExprAST* call = ast.asOrNull<CallExprAST>(id)) {
+				if (!calls(call->Callee, call->Args.size()))
+					return false;
+			}
+			else if (BinaryExprAST* binary = ast.asOrNull<BinaryExprAST>(id)) {
+				if (!builtinOperators[binary->op].builtin &&
+					!(operators.hasBinaryFunction(binary->op) && calls(operators.binaryFunction(binary->op), 2)))
+					return false;
+			}
+			else if (UnaryExprAST* unary = ast.asOrNull<UnaryExprAST>(id)) {
+				if (!(operators.hasUnaryFunction(unary->op) && calls(operators.unaryFunction(unary->op), 1)))
+					return false;
+			}
+			ast.forEachChild(node, [&](ExprId &child) { pending.push_back(child); });
+		}
+		return true;
+	}
+
+	ExprId Simplifier::evaluateCall(ExprId id)
+	{
+		if (!evaluator.stepLimit)
+			return ExprId();
+		double result;
+		if (!evaluator.evaluate(id, result)) {
+			callsNotEvaluated++;
+			return ExprId();
+		}
+		callsEvaluated++;
+		KTRACE(tracePass, traceDebug, "evaluated call", "value", result);
+		return number(result);
+	}
+
+	void Simplifier::simplifyRange(uint32_t begin, uint32_t end)
+	{
+		if (replacement.size() < ast.size())
+			replacement.resize(ast.size());
+		if (done.size() < ast.size())
+			done.resize(ast.size(), false);
+
+		for (uint32_t i = begin; i < end; i++) {
+			if (done[i])
+				continue;
+			ExprId id(i);
+			ExprAST* node = ast.get(id);
+			ast.forEachChild(node, [this](ExprId &child) { child = resolve(child); });
+			uint32_t created = ast.size();
+			ExprId result = dispatch(id, id);
+			//nodes made by visit() are final
+			if (ast.size() > replacement.size()) {
+				replacement.resize(ast.size());
+				done.resize(ast.size(), false);
+			}
+			for (uint32_t n = created; n < ast.size(); n++)
+				done[n] = true;
+			done[i] = true;
+			if (result && result != id)
+				replacement[i] = result;
+		}
+	}
+
+	void Simplifier::addDefinition(ExprId item)
+	{
+		FunctionAST* fn = ast.asOrNull<FunctionAST>(item);
+		PrototypeAST* proto = fn ? ast.as<PrototypeAST>(fn->Proto) : nullptr;
+		if (!proto || proto->Anonymous)
+			return;
+
+		SymbolId name = proto->Name;
+		if (name >= definitions.size()) {
+			definitions.resize(name + 1);
+			pureFunctions.resize(name + 1);
+			recursiveFunctions.resize(name + 1);
+		}
+		//a redefinition is an error; do not evaluate or specialize calls against either body
+		if (definitions[name]) {
+			pureFunctions[name] = ExprId();
+			return;
+		}
+		definitions[name] = item;
+
+		bool recursive;
+		if (isPure(fn, name, recursive)) {
+			pureFunctions[name] = item;
+			recursiveFunctions[name] = recursive;
+			functionsPure++;
+			KTRACE(tracePass, traceDebug, "pure function", "name", symbols.str(name));
+		}
+	}
+
+	bool Simplifier::isFastMath(ExprId item) const
+	{
+		FunctionAST* fn = ast.asOrNull<FunctionAST>(item);
+		FloatMode mode = fn ? ast.as<PrototypeAST>(fn->Proto)->Float : floatDefault;
+		return mode == floatFast || (mode == floatDefault && defaultFastMath);
+	}
+
+	void Simplifier::run(ExprId item)
+	{
+		uint32_t end = item.index + 1;
+		if (end <= nextNode)
+			return;
+
+		bool counting = stats::enabled();
+		if (counting)
+			nodesBefore += countNodes(item);
+
+		fastMath = isFastMath(item);
+		simplifyRange(nextNode, end);
+		nextNode = end;
+		addDefinition(item);
+		specializeCalls(item);
+
+		//clones may ask for further clones
+		for (size_t i = 0; i < pendingSpecializations.size(); i++) {
+			Specialization spec = pendingSpecializations[i];
+			buildSpecialization(spec);
+		}
+		pendingSpecializations.clear();
+
+		if (counting)
+			nodesAfter += countNodes(item);
+	}
+
+	void Simplifier::specializeCalls(ExprId root)
+	{
+		if (!specializeBudget)
+			return;
+		std::vector<ExprId> nodes;
+		countNodes(root, &nodes);
+		double arg;
+		for (ExprId id : nodes) {
+			CallExprAST* call = ast.asOrNull<CallExprAST>(id);
+			if (!call)
+				continue;
+			for (ExprId argId : ast.exprList(call->Args))
+				if (isNumber(argId, arg)) {
+					specializeCall(call);
+					break;
+				}
+		}
+	}
+
+	bool Simplifier::specializeCall(CallExprAST* callExprAST)
+	{
+		SymbolId callee = callExprAST->Callee;
+		ExprId fnId = callee < definitions.size() ? definitions[callee] : ExprId();
+		if (!fnId)
+			return false;
+		FunctionAST* fn = ast.as<FunctionAST>(fnId);
+		auto params = ast.symbolList(ast.as<PrototypeAST>(fn->Proto)->Args);
+		auto args = ast.exprList(callExprAST->Args);
+		if (params.size() != args.size())
+			return false;
+
+		std::vector<ExprId> body;
+		size_t size = countNodes(fn->Body, &body, MaxSpecializeNodes + 1);
+		if (size > MaxSpecializeNodes)
+			return false;
+
+		std::vector<SymbolId> assigned;
+		for (ExprId id : body) {
+			BinaryExprAST* binary = ast.asOrNull<BinaryExprAST>(id);
+			VariableExprAST* dest = binary && binary->op == '=' ? ast.asOrNull<VariableExprAST>(binary->LHS) : nullptr;
+			if (dest)
+				assigned.push_back(dest->Name);
+		}
+
+		std::vector<uint64_t> key(1, callee);
+		std::vector<ExprId> constants(params.size());
+		std::vector<ExprId> remaining;
+		for (uint32_t i = 0; i < params.size(); i++) {
+			NumberExprAST* num = ast.asOrNull<NumberExprAST>(args[i]);
+			if (num && std::find(assigned.begin(), assigned.end(), params[i]) == assigned.end()) {
+				uint64_t bits;
+				memcpy(&bits, &num->Val, sizeof(bits));
+				key.push_back(1);
+				key.push_back(bits);
+				constants[i] = args[i];
+			}
+			else {
+				key.push_back(0);
+				remaining.push_back(args[i]);
+			}
+		}
+		if (remaining.size() == params.size())
+			return false;
+
+		SymbolId name;
+		auto cached = specializationCache.find(key);
+		if (cached != specializationCache.end())
+			name = cached->second;
+		else {
+			if (size > specializeBudget)
+				return false;
+			specializeBudget -= size;
+			name = symbols.intern(std::string(symbols.str(callee)) + ".spec" + std::to_string(specializationCache.size()));
+			specializationCache.emplace(key, name);
+			pendingSpecializations.push_back({name, fnId, constants});
+		}
+
+		//in place: the clone computes the same value wherever the call is shared
+		callExprAST->Callee = name;
+		callExprAST->Args = ast.addExprList(remaining.data(), remaining.size());
+		callsSpecialized++;
+		return true;
+	}
+
+	void Simplifier::buildSpecialization(const Specialization &spec)
+	{
+		FunctionAST* fn = ast.as<FunctionAST>(spec.callee);
+		PrototypeAST* proto = ast.as<PrototypeAST>(fn->Proto);
+		auto params = ast.symbolList(proto->Args);
+
+		std::vector<std::pair<SymbolId, ExprId>> substitutions;
+		std::vector<SymbolId> remaining;
+		for (uint32_t i = 0; i < params.size(); i++) {
+			if (spec.constants[i])
+				substitutions.emplace_back(params[i], spec.constants[i]);
+			else
+				remaining.push_back(params[i]);
+		}
+
+		//Copy, children first, every node that (transitively) reads a replaced parameter; everything
+		//else is shared with the original body
+		std::vector<ExprId> body;
+		countNodes(fn->Body, &body);
+		std::sort(body.begin(), body.end(), [](ExprId a, ExprId b) { return a.index < b.index; });
+
+		uint32_t first = ast.size();
+		std::unordered_map<uint32_t, ExprId> copies;
+		auto copyOf = [&](ExprId id) {
+			auto found = copies.find(id.index);
+			return found == copies.end() ? id : found->second;
+		};
+		for (ExprId id : body) {
+			ExprAST* node = ast.get(id);
+			if (VariableExprAST* var = ast.asOrNull<VariableExprAST>(id)) {
+				for (auto &sub : substitutions)
+					if (sub.first == var->Name)
+						copies[id.index] = ast.create<NumberExprAST>(ast.as<NumberExprAST>(sub.second)->Val);
+				continue;
+			}
+			bool changed = false;
+			ast.forEachChild(node, [&](ExprId &child) { changed |= copies.count(child.index) != 0; });
+			if (!changed)
+				continue;
+
+			ExprId copy;
+			switch (node->getType()) {
+				case exprTypeBinaryExpr: {
+					BinaryExprAST* e = static_cast<BinaryExprAST*>(node);
+					copy = ast.create<BinaryExprAST>(e->op, copyOf(e->LHS), copyOf(e->RHS));
+					break;
+				}
+				case exprTypeUnary: {
+					UnaryExprAST* e = static_cast<UnaryExprAST*>(node);
+					copy = ast.create<UnaryExprAST>(e->op, copyOf(e->Operand));
+					break;
+				}
+				case exprTypeCall: {
+					CallExprAST* e = static_cast<CallExprAST*>(node);
+					std::vector<ExprId> args;
+					for (ExprId arg : ast.exprList(e->Args))
+						args.push_back(copyOf(arg));
+					copy = ast.create<CallExprAST>(e->Callee, ast.addExprList(args.data(), args.size()));
+					break;
+				}
+				case exprTypeIf: {
+					IfExprAST* e = static_cast<IfExprAST*>(node);
+					copy = ast.create<IfExprAST>(copyOf(e->Cond), copyOf(e->Then), copyOf(e->Else));
+					break;
+				}
+				case exprTypeFor: {
+					ForExprAST* e = static_cast<ForExprAST*>(node);
+					copy = ast.create<ForExprAST>(e->InductionVarName, copyOf(e->Start), copyOf(e->End), copyOf(e->Step), copyOf(e->Body));
+					break;
+				}
+				case exprTypeVarExpr: {
+					VarExprAST* e = static_cast<VarExprAST*>(node);
+					std::vector<VarBinding> bindings;
+					for (VarBinding binding : ast.varBindingList(e->VarNames)) {
+						if (binding.Init)
+							binding.Init = copyOf(binding.Init);
+						bindings.push_back(binding);
+					}
+					copy = ast.create<VarExprAST>(ast.addVarBindings(bindings.data(), bindings.size()), copyOf(e->Body));
+					break;
+				}
+				default:
+					continue;
+			}
+			copies[id.index] = copy;
+		}
+
+		ExprId cloneProto = ast.create<PrototypeAST>(spec.name, ast.addSymbolList(remaining));
+		ast.as<PrototypeAST>(cloneProto)->Internal = true;
+		ast.as<PrototypeAST>(cloneProto)->Float = ast.as<PrototypeAST>(fn->Proto)->Float;
+		ExprId clone = ast.create<FunctionAST>(cloneProto, copyOf(fn->Body));
+		nodesCloned += ast.size() - first;
+		functionsSpecialized++;
+		KTRACE(tracePass, traceDebug, "specialized function", "name", symbols.str(spec.name), "nodes", ast.size() - first);
+
+		//the clone follows its function's mode, not the caller's
+		bool callerFastMath = fastMath;
+		fastMath = isFastMath(clone);
+		simplifyRange(first, ast.size());
+		fastMath = callerFastMath;
+		//a clone of a pure function is pure, even before the clones it calls exist
+		SymbolId original = proto->Name;
+		definitions.resize(std::max<size_t>(definitions.size(), spec.name + 1));
+		pureFunctions.resize(definitions.size());
+		recursiveFunctions.resize(definitions.size());
+		definitions[spec.name] = clone;
+		if (isPureFunction(original)) {
+			pureFunctions[spec.name] = clone;
+			recursiveFunctions[spec.name] = recursiveFunctions[original];
+		}
+		specializeCalls(clone);
+		specializations.push_back(clone);
+	}
+
+	std::vector<ExprId> Simplifier::takeSpecializations()
+	{
+		std::vector<ExprId> taken;
+		taken.swap(specializations);
+		return taken;
+	}
+
+	ExprId Simplifier::visit(NumberExprAST* /*numExprAST*/, ExprId id)
+	{
+		setEffectFree(id, true);
+		return id;
+	}
+
+	ExprId Simplifier::visit(VariableExprAST* /*variableExprAST*/, ExprId id)
+	{
+		setEffectFree(id, true);
+		return id;
+	}
+
+	ExprId Simplifier::visit(BinaryExprAST* binaryExprAST, ExprId id)
+	{
+		uint8_t op = binaryExprAST->op;
+		ExprId LHS = binaryExprAST->LHS, RHS = binaryExprAST->RHS;
+		if (op == '=')
+			return id;
+
+		double L = 0, R = 0;
+		bool constL = isNumber(LHS, L), constR = isNumber(RHS, R);
+		if (!builtinOperators[op].builtin) {
+			//user-defined operator: a call, which can only be evaluated
+			ExprId value = constL && constR && isPureFunction(operators.binaryFunction(op)) ? evaluateCall(id) : ExprId();
+			return value ? value : id;
+		}
+		if (constL && constR) {
+			double result;
+			switch (op)
+			{
+				case '+': result = L + R; break;
+				case '-': result = L - R; break;
+				case '*': result = L * R; break;
+				case '/': result = L / R; break;
+				//unordered comparisons, as emitted by codegen
+				case '<': result = !(L >= R) ? 1.0 : 0.0; break;
+				case '>': result = !(L <= R) ? 1.0 : 0.0; break;
+				//codegen tests operands with an ordered '!= 0.0'
+				case '&': result = (L < 0.0 || L > 0.0) && (R < 0.0 || R > 0.0) ? 1.0 : 0.0; break;
+				case '|': result = (L < 0.0 || L > 0.0) || (R < 0.0 || R > 0.0) ? 1.0 : 0.0; break;
+				default: result = R; break;
+			}
+			constantsFolded++;
+			KTRACE(tracePass, traceDebug, "folded constant", "op", (char)op, "value", result);
+			return number(result);
+		}
+
+		ExprId simplified = ExprId();
+		switch (op)
+		{
+			case ':':
+				if (isEffectFree(LHS))
+					simplified = RHS;
+				break;
+			case '+':
+				//only -0.0 is an identity for IEEE addition: -0.0 + 0.0 is 0.0
+				if (constR && R == 0.0 && (std::signbit(R) || fastMath))
+					simplified = LHS;
+				else if (constL && L == 0.0 && (std::signbit(L) || fastMath))
+					simplified = RHS;
+				break;
+			case '-':
+				if (constR && R == 0.0 && (!std::signbit(R) || fastMath))
+					simplified = LHS;
+				else if (fastMath && LHS == RHS && isEffectFree(LHS))
+					simplified = number(0.0);
+				break;
+			case '*':
+				if (constR && R == 1.0)
+					simplified = LHS;
+				else if (constL && L == 1.0)
+					simplified = RHS;
+				//not IEEE: NaN * 0, inf * 0 and -x * 0
+				else if (fastMath && ((constR && R == 0.0 && isEffectFree(LHS)) || (constL && L == 0.0 && isEffectFree(RHS))))
+					simplified = number(0.0);
+				break;
+			case '/':
+				if (constR && R == 1.0)
+					simplified = LHS;
+				break;
+			//a left side that decides the result: the right side is never evaluated
+			case '&':
+				if (constL && !(L < 0.0 || L > 0.0))
+					simplified = number(0.0);
+				break;
+			case '|':
+				if (constL && (L < 0.0 || L > 0.0))
+					simplified = number(1.0);
+				break;
+			default:
+				break;
+		}
+
+		//(x + c1) + c2 => x + (c1 + c2), and the same for '*'; rounds differently, so fast-math only
+		BinaryExprAST* inner = ast.asOrNull<BinaryExprAST>(LHS);
+		double C;
+		if (!simplified && fastMath && constR && (op == '+' || op == '*') && inner && inner->op == op && isNumber(inner->RHS, C)) {
+			simplified = ast.create<BinaryExprAST>(op, inner->LHS, number(op == '+' ? C + R : C * R));
+			setEffectFree(simplified, isEffectFree(inner->LHS));
+		}
+
+		if (simplified) {
+			identitiesApplied++;
+			return simplified;
+		}
+		setEffectFree(id, isEffectFree(LHS) && isEffectFree(RHS));
+		return id;
+	}
+
+	ExprId Simplifier::visit(UnaryExprAST* unaryExprAST, ExprId id)
+	{
+		double operand;
+		if (isNumber(unaryExprAST->Operand, operand) && isPureFunction(operators.unaryFunction(unaryExprAST->op))) {
+			ExprId value = evaluateCall(id);
+			if (value)
+				return value;
+		}
+		return id;
+	}
+
+	ExprId Simplifier::visit(CallExprAST* callExprAST, ExprId id)
+	{
+		if (!isPureFunction(callExprAST->Callee))
+			return id;
+		double arg;
+		for (ExprId argId : ast.exprList(callExprAST->Args))
+			if (!isNumber(argId, arg))
+				return id;
+		ExprId value = evaluateCall(id);
+		return value ? value : id;
+	}
+
+	ExprId Simplifier::visit(PrototypeAST* /*protoExprAST*/, ExprId id)
+	{
+		return id;
+	}
+
+	ExprId Simplifier::visit(FunctionAST* /*fnExprAST*/, ExprId id)
+	{
+		return id;
+	}
+
+	ExprId Simplifier::visit(IfExprAST* ifExprAST, ExprId id)
+	{
+		double cond;
+		if (isNumber(ifExprAST->Cond, cond)) {
+			//codegen tests the condition with an ordered '!= 0.0'
+			branchesPruned++;
+			return cond < 0.0 || cond > 0.0 ? ifExprAST->Then : ifExprAST->Else;
+		}
+		if (ifExprAST->Then == ifExprAST->Else && isEffectFree(ifExprAST->Cond)) {
+			branchesPruned++;
+			return ifExprAST->Then;
+		}
+		setEffectFree(id, isEffectFree(ifExprAST->Cond) && isEffectFree(ifExprAST->Then) && isEffectFree(ifExprAST->Else));
+		return id;
+	}
+
+	ExprId Simplifier::visit(ForExprAST* forExprAST, ExprId id)
+	{
+		//The end condition is tested before the first iteration, so with a false literal the body
+		//never runs and only the start value is evaluated: start : 0
+		double end;
+		if (!isNumber(forExprAST->End, end) || end < 0.0 || end > 0.0)
+			return id;
+
+		loopsPruned++;
+		if (isEffectFree(forExprAST->Start))
+			return number(0.0);
+		return ast.create<BinaryExprAST>(':', forExprAST->Start, number(0.0));
+	}
+
+	ExprId Simplifier::visit(VarExprAST* varExprAST, ExprId id)
+	{
+		bool pure = isEffectFree(varExprAST->Body);
+		for (const VarBinding &binding : ast.varBindingList(varExprAST->VarNames))
+			if (binding.Init && !isEffectFree(binding.Init))
+				pure = false;
+		setEffectFree(id, pure);
+		return id;
+	}
+
+}
@@ -0,0 +1,193 @@
+#ifndef SIMPLIFY_DEFINED
+#define SIMPLIFY_DEFINED
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#ifndef AST_DEFINED
+#include "AST.h"
+#define AST_DEFINED
+#endif
+
+#include "ASTVisitor.h"
+#include "Eval.h"
+#include "Interner.h"
+#include "Operators.h"
+
+namespace myCompiler {
+
+//Rewrites each top-level item before codegen: folds builtin operators on literals, drops operations
+//that cannot change the value (x * 1, x - 0.0, a side-effect-free left side of ':'), keeps only the
+//taken branch of an 'if' with a literal condition, and turns a 'for' whose end condition is a false
+//literal into 'start : 0', since the end is tested before the body ever runs. Identities that do not
+//hold for every IEEE value (x + 0.0, x * 0.0, x - x, reassociation) are only used in fast-math
+//functions: 'def fast', or any function but 'def strict' ones when the command line's flags allow
+//them (see fpSimplifyFlags).
+//
+//Functions are checked for purity as they are simplified: a function is pure if everything it calls,
+//directly or through an operator, is itself or an earlier pure function (externs never are; variables
+//are always local to their function). A call to a pure function with literal arguments is replaced
+//by its value, computed by the Evaluator within a step budget.
+//
+//A call to a small function with some literal arguments is redirected to a specialization: an
+//internal clone of the function ('<name>.spec<n>') with those parameters replaced by the literals,
+//simplified like any other function. Parameters the body assigns to are left alone. Clones are
+//shared by every call with the same literals, and their total size is bounded by specializeBudget.
+//Calls are only redirected once their function is simplified, so a recursion that ends in a pruned
+//branch stops making clones there.
+//
+//A node is always created after its children, so visiting ids in increasing order simplifies every
+//child before its parent without recursing. visit() returns the node to use in place of the visited
+//one; parents then pick up the replacements of their children.
+class Simplifier : public ASTVisitor<Simplifier, ExprId> {
+
+	private:
+
+	//for the function being simplified, and for the functions that follow no 'def fast'/'def strict'
+	bool fastMath = false;
+	bool defaultFastMath;
+
+	bool isFastMath(ExprId item) const;
+
+	StringInterner &symbols;
+
+	const OperatorTable &operators;
+
+	//first definition of every function by SymbolId
+	std::vector<ExprId> definitions;
+
+	//body of each pure function by SymbolId, invalid for every other name
+	std::vector<ExprId> pureFunctions;
+	std::vector<bool> recursiveFunctions;
+	Evaluator evaluator;
+
+	//largest function body that is specialized, in nodes
+	static const size_t MaxSpecializeNodes = 256;
+	//nodes specializations may still add
+	size_t specializeBudget;
+
+	//clone to build: 'constants' holds the literal for each parameter that is replaced, or invalid
+	struct Specialization {
+		SymbolId name;
+		ExprId callee;
+		std::vector<ExprId> constants;
+	};
+	//callee, then per parameter a flag and the literal's bits, to the specialization's name
+	std::map<std::vector<uint64_t>, SymbolId> specializationCache;
+	std::vector<Specialization> pendingSpecializations;
+	//clones built and simplified, not yet handed out by takeSpecializations
+	std::vector<ExprId> specializations;
+
+	//first node not yet simplified
+	uint32_t nextNode = 0;
+	//node is simplified (or was created by the simplifier) and must not be visited again
+	std::vector<bool> done;
+	//node that replaces each node, invalid where the node stays
+	std::vector<ExprId> replacement;
+	//node can be evaluated and its value thrown away without any visible effect
+	std::vector<uint8_t> effectFree;
+	//reachable-node counting, see countNodes
+	std::vector<uint32_t> visitedIn;
+	uint32_t visitStamp = 0;
+
+	ExprId resolve(ExprId id) const
+	{
+		return id && id.index < replacement.size() && replacement[id.index] ? replacement[id.index] : id;
+	}
+
+	bool isEffectFree(ExprId id) const { return id.index < effectFree.size() && effectFree[id.index]; }
+
+	void setEffectFree(ExprId id, bool value);
+
+	bool isNumber(ExprId id, double &val) const;
+
+	ExprId number(double val);
+
+	//Nodes reachable from 'root', each shared node counted once, optionally collected in 'nodes'.
+	//Counting stops after 'limit' nodes.
+	size_t countNodes(ExprId root, std::vector<ExprId>* nodes = nullptr, size_t limit = SIZE_MAX);
+
+	void simplifyRange(uint32_t begin, uint32_t end);
+
+	//records a function definition after its body is simplified, and checks whether it is pure
+	void addDefinition(ExprId item);
+
+	//Redirects calls with literal arguments reachable from 'root' to specializations. Runs after
+	//'root' is simplified, so calls in pruned branches do not ask for clones.
+	void specializeCalls(ExprId root);
+
+	//turns the call into a call of a specialization for its literal arguments, if there is one
+	bool specializeCall(CallExprAST* callExprAST);
+
+	//builds the clone for a pending specialization and simplifies it
+	void buildSpecialization(const Specialization &spec);
+
+	//'recursive' is set if the function calls itself
+	bool isPure(FunctionAST* fnExprAST, SymbolId self, bool &recursive);
+
+	//number for the value of a call with literal arguments, or invalid if it cannot be evaluated
+	ExprId evaluateCall(ExprId id);
+
+	public:
+
+	//evalSteps bounds the work spent on each call evaluated at compile time, 0 evaluates none;
+	//_specializeBudget bounds the nodes added by specialization, 0 specializes nothing
+	Simplifier(ASTContext &_ast, StringInterner &_symbols, const OperatorTable &_operators, uint64_t evalSteps,
+			   size_t _specializeBudget, bool _defaultFastMath = false)
+		: ASTVisitor(_ast), defaultFastMath(_defaultFastMath), symbols(_symbols), operators(_operators),
+		  evaluator(_ast, _operators, pureFunctions, evalSteps), specializeBudget(_specializeBudget) {}
+
+	//Simplifies every node created since the previous run, up to and including 'item'
+	void run(ExprId item);
+
+	//also false for OperatorTable's "no function"
+	bool isPureFunction(uint32_t name) const { return name < pureFunctions.size() && pureFunctions[name]; }
+
+	//pure and calls itself
+	bool isPureRecursive(uint32_t name) const { return isPureFunction(name) && recursiveFunctions[name]; }
+
+	//Specializations built since the last call, which codegen must emit before the item the last
+	//run() simplified
+	std::vector<ExprId> takeSpecializations();
+
+	//Every visit() is passed the id of the node it is given
+	ExprId visit(NumberExprAST* numExprAST, ExprId id);
+
+	ExprId visit(VariableExprAST* variableExprAST, ExprId id);
+
+	ExprId visit(BinaryExprAST* binaryExprAST, ExprId id);
+
+	ExprId visit(UnaryExprAST* unaryExprAST, ExprId id);
+
+	ExprId visit(CallExprAST* callExprAST, ExprId id);
+
+	ExprId visit(PrototypeAST* protoExprAST, ExprId id);
+
+	ExprId visit(FunctionAST* fnExprAST, ExprId id);
+
+	ExprId visit(IfExprAST* ifExprAST, ExprId id);
+
+	ExprId visit(ForExprAST* forExprAST, ExprId id);
+
+	ExprId visit(VarExprAST* varExprAST, ExprId id);
+
+	//counts for --stats; nodes are only counted while stats are enabled
+	size_t nodesBefore = 0;
+	size_t nodesAfter = 0;
+	size_t constantsFolded = 0;
+	size_t identitiesApplied = 0;
+	size_t branchesPruned = 0;
+	size_t loopsPruned = 0;
+	size_t functionsPure = 0;
+	size_t callsEvaluated = 0;
+	size_t callsNotEvaluated = 0;
+	uint64_t evalSteps() const { return evaluator.steps; }
+	size_t functionsSpecialized = 0;
+	size_t callsSpecialized = 0;
+	size_t nodesCloned = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef SOURCEBUFFER_DEFINED
+#define SOURCEBUFFER_DEFINED
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOURCEBUFFER_HAVE_MMAP 1
+#endif
+
+//Contiguous view of the source program handed to the lexer.
+//The lexer scans the window [cur, end) directly and slices tokens out of it with std::string_view,
+//so every byte handed out must stay valid for the lifetime of the buffer.
+class SourceBuffer {
+	public:
+
+	virtual ~SourceBuffer() {}
+
+	//First window of the input
+	virtual void window(const char* &cur, const char* &end) = 0;
+
+	//Called when the lexer runs off the end of the window. Bytes from tokStart onwards belong to the token
+	//being scanned and must be kept contiguous with the new data. Updates all three pointers and returns
+	//false once the input is exhausted.
+	virtual bool refill(const char* &cur, const char* &tokStart, const char* &end) = 0;
+
+	//Total bytes of input made available so far
+	virtual size_t bytesRead() = 0;
+
+	//"-" reads stdin. Regular files are memory mapped, anything else (pipes, ttys, character devices)
+	//goes through the chunked reader.
+	static std::unique_ptr<SourceBuffer> open(const char* fileName);
+};
+
+#ifdef SOURCEBUFFER_HAVE_MMAP
+//Whole file mapped read-only; there is never anything to refill.
+class MappedSourceBuffer : public SourceBuffer {
+
+	private:
+
+	void* base;
+	size_t length;
+
+	public:
+
+	MappedSourceBuffer(void* _base, size_t _length) : base(_base), length(_length) {
+		madvise(base, length, MADV_SEQUENTIAL);
+	}
+
+	~MappedSourceBuffer() {
+		munmap(base, length);
+	}
+
+	void window(const char* &cur, const char* &end) override {
+		cur = static_cast<const char*>(base);
+		end = cur + length;
+	}
+
+	bool refill(const char* &/*cur*/, const char* &/*tokStart*/, const char* &/*end*/) override {
+		return false;
+	}
+
+	size_t bytesRead() override {
+		return length;
+	}
+};
+#endif
+
+//Buffered reader for stdin and pipes. Data is read in large chunks; a token that straddles two chunks is
+//copied to the front of the next one. Chunks are never released before the reader so earlier token
+//slices stay valid.
+class ChunkedSourceBuffer : public SourceBuffer {
+
+	private:
+
+	static const size_t ChunkSize = 1 << 20;
+
+	FILE* file;
+	bool ownsFile;
+	bool atEOF;
+	size_t totalRead;
+	std::vector<std::unique_ptr<char[]>> chunks;
+
+	public:
+
+	ChunkedSourceBuffer(FILE* _file, bool _ownsFile) : file(_file), ownsFile(_ownsFile), atEOF(false), totalRead(0) {
+	}
+
+	~ChunkedSourceBuffer() {
+		if (ownsFile && file)
+			fclose(file);
+	}
+
+	void window(const char* &cur, const char* &end) override {
+		cur = end = nullptr;
+	}
+
+	bool refill(const char* &cur, const char* &tokStart, const char* &end) override {
+		if (atEOF || !file)
+			return false;
+
+		if (!tokStart)
+			tokStart = cur;
+		size_t carried = end - tokStart;
+		size_t scanned = cur - tokStart;
+		size_t size = ChunkSize;
+		while (size < 2 * carried)
+			size *= 2;
+
+		std::unique_ptr<char[]> chunk(new char[size]);
+		if (carried)
+			memcpy(chunk.get(), tokStart, carried);
+
+		size_t got = fread(chunk.get() + carried, 1, size - carried, file);
+		if (got < size - carried)
+			atEOF = true;
+		if (got == 0)
+			return false;
+		totalRead += got;
+
+		tokStart = chunk.get();
+		cur = tokStart + scanned;
+		end = tokStart + carried + got;
+		chunks.push_back(std::move(chunk));
+		return true;
+	}
+
+	size_t bytesRead() override {
+		return totalRead;
+	}
+};
+
+inline std::unique_ptr<SourceBuffer> SourceBuffer::open(const char* fileName)
+{
+	if (std::string(fileName) == "-")
+		return std::unique_ptr<SourceBuffer>(new ChunkedSourceBuffer(stdin, false));
+
+#ifdef SOURCEBUFFER_HAVE_MMAP
+	int fd = ::open(fileName, O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (base != MAP_FAILED) {
+				::close(fd);
+				return std::unique_ptr<SourceBuffer>(new MappedSourceBuffer(base, st.st_size));
+			}
+		}
+		::close(fd);
+	}
+#endif
+
+	return std::unique_ptr<SourceBuffer>(new ChunkedSourceBuffer(fopen(fileName, "rb"), true));
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef STATS_DEFINED
+#define STATS_DEFINED
+
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Named counters passes bump while compiling; --stats prints them when the compile is done, in the
+//order they were first added to.
+namespace stats {
+
+struct State {
+	bool enabled = false;
+	std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+inline State& state()
+{
+	static State s;
+	return s;
+}
+
+inline bool enabled() { return state().enabled; }
+
+inline void add(const char* name, uint64_t count)
+{
+	State &s = state();
+	for (auto &counter : s.counters) {
+		if (counter.first == name) {
+			counter.second += count;
+			return;
+		}
+	}
+	s.counters.emplace_back(name, count);
+}
+
+inline void print(std::ostream &os)
+{
+	os << "=== compile statistics ===\n";
+	for (auto &counter : state().counters)
+		os << std::setw(12) << counter.second << "  " << counter.first << "\n";
+}
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SYMBOLTABLE_DEFINED
+#define SYMBOLTABLE_DEFINED
+
+#include <cstdint>
+#include <vector>
+
+//Flat symbol table indexed by interned SymbolId. Bindings made inside a scope are recorded in an undo
+//log, and popScope() restores whatever the symbols were bound to before, so shadowing and sibling
+//scopes cost a vector write each instead of a string-keyed map insert/erase.
+template <typename T>
+class ScopedSymbolTable {
+
+	private:
+
+	struct Shadowed {
+		uint32_t sym;
+		T previous;
+	};
+
+	std::vector<T> bound;
+	std::vector<Shadowed> undoLog;
+	std::vector<size_t> scopeStarts;
+
+	public:
+
+	T lookup(uint32_t sym) const
+	{
+		return sym < bound.size() ? bound[sym] : T();
+	}
+
+	void bind(uint32_t sym, T value)
+	{
+		if (sym >= bound.size())
+			bound.resize(sym + 1, T());
+		undoLog.push_back({sym, bound[sym]});
+		bound[sym] = value;
+	}
+
+	void pushScope()
+	{
+		scopeStarts.push_back(undoLog.size());
+	}
+
+	void popScope()
+	{
+		size_t start = scopeStarts.back();
+		scopeStarts.pop_back();
+		while (undoLog.size() > start) {
+			bound[undoLog.back().sym] = undoLog.back().previous;
+			undoLog.pop_back();
+		}
+	}
+
+	//Drops every binding, e.g. between functions
+	void clear()
+	{
+		while (!scopeStarts.empty())
+			popScope();
+		for (const Shadowed &s : undoLog)
+			bound[s.sym] = T();
+		undoLog.clear();
+	}
+};
+
+#endif
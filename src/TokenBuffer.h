@@ -0,0 +1,77 @@
+#ifndef TOKENBUFFER_DEFINED
+#define TOKENBUFFER_DEFINED
+
+#include <cstdint>
+#include <vector>
+
+#include "Lexer.h"
+#include "Interner.h"
+
+//Whole input lexed up front, stored as parallel arrays indexed by token number.
+//  kinds    - lexer::Token
+//  values   - interned identifier id for tok_identifier, literal pool index for tok_number, the character for tok_unknown
+//  lines    - 1-based line of the first byte of the token
+//  columns  - 1-based column of the first byte of the token
+//The last entry is always tok_eof so lookahead past the end stays in bounds.
+class TokenBuffer {
+
+	public:
+
+	typedef lexer::tokStruct tokStruct;
+
+	std::vector<int8_t> kinds;
+	std::vector<uint32_t> values;
+	std::vector<uint32_t> lines;
+	std::vector<uint32_t> columns;
+	std::vector<double> literals;
+	//the lexer's interner; identifier ids index into it
+	StringInterner* identifiers = nullptr;
+
+	void lexAll(lexer &lex, StringInterner &_identifiers)
+	{
+		identifiers = &_identifiers;
+		while (1) {
+			tokStruct tok = lex.getTok();
+			uint32_t value = 0;
+			if (tok.tok == lexer::tok_identifier)
+				value = tok.identId;
+			else if (tok.tok == lexer::tok_number) {
+				value = literals.size();
+				literals.push_back(tok.numVal);
+			}
+			else if (tok.tok == lexer::tok_unknown)
+				value = (unsigned char)tok.unknownChar;
+
+			kinds.push_back(tok.tok);
+			values.push_back(value);
+			lines.push_back(tok.line);
+			columns.push_back(tok.column);
+
+			if (tok.tok == lexer::tok_eof)
+				break;
+		}
+	}
+
+	size_t size() const { return kinds.size(); }
+
+	//Token i in the form the parser consumes; indices past the end read as the final tok_eof
+	tokStruct get(size_t i) const
+	{
+		if (i >= kinds.size())
+			i = kinds.size() - 1;
+
+		lexer::Token kind = (lexer::Token)kinds[i];
+		tokStruct tok(kind);
+		if (kind == lexer::tok_identifier)
+			tok = tokStruct(identifiers->str(values[i]), values[i]);
+		else if (kind == lexer::tok_number)
+			tok = tokStruct(literals[values[i]]);
+		else if (kind == lexer::tok_unknown)
+			tok = tokStruct((char)values[i]);
+		tok.line = lines[i];
+		tok.column = columns[i];
+		return tok;
+	}
+};
+
+#endif
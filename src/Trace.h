@@ -0,0 +1,221 @@
+#ifndef TRACE_DEFINED
+#define TRACE_DEFINED
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+//Structured tracing. Every event is one JSON object per line on the sink:
+//  {"t":123,"cat":"parser","level":"error","msg":"expected ')'","line":3,"col":7}
+//
+//Events are filtered twice:
+//  - at compile time by KALEIDO_TRACE_LEVEL and KALEIDO_TRACE_CATEGORIES; anything above the ceiling is
+//    a constant-false branch and compiles away entirely
+//  - at run time by the level and category mask set from the command line (--trace, --trace-level)
+//KTRACE only evaluates its arguments after both checks pass, so a disabled event costs one load and
+//one branch and never formats anything.
+
+#ifndef KALEIDO_TRACE_LEVEL
+#define KALEIDO_TRACE_LEVEL 3
+#endif
+
+#ifndef KALEIDO_TRACE_CATEGORIES
+#define KALEIDO_TRACE_CATEGORIES 0xFFFFFFFFu
+#endif
+
+namespace trace {
+
+enum Category : uint32_t {
+	traceLexer = 1,
+	traceParser = 2,
+	traceCodegen = 4,
+	tracePass = 8,
+	traceAll = 0xFFFFFFFFu,
+};
+
+enum Level : int {
+	traceError = 0,
+	traceWarn = 1,
+	traceInfo = 2,
+	traceDebug = 3,
+};
+
+//Run-time filter, read on every KTRACE
+inline uint32_t activeCategories = traceAll;
+inline int activeLevel = traceError;
+
+//When set, this thread's events are appended here instead of written out; the owner passes the text
+//to flush() later, which lets parallel work report its diagnostics in a deterministic order
+inline thread_local std::string* captureBuffer = nullptr;
+
+struct State {
+	std::ostream* sink = &std::cerr;
+	std::unique_ptr<std::ofstream> file;
+	std::mutex lock;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+inline State& state()
+{
+	static State s;
+	return s;
+}
+
+inline bool enabled(Category cat, Level level)
+{
+	return level <= KALEIDO_TRACE_LEVEL && (cat & KALEIDO_TRACE_CATEGORIES) &&
+		level <= activeLevel && (cat & activeCategories);
+}
+
+inline const char* categoryName(Category cat)
+{
+	switch (cat) {
+		case traceLexer: return "lexer";
+		case traceParser: return "parser";
+		case traceCodegen: return "codegen";
+		case tracePass: return "pass";
+		default: return "all";
+	}
+}
+
+inline const char* levelName(Level level)
+{
+	switch (level) {
+		case traceError: return "error";
+		case traceWarn: return "warn";
+		case traceInfo: return "info";
+		default: return "debug";
+	}
+}
+
+inline void writeString(std::ostream &os, std::string_view str)
+{
+	os << '"';
+	for (char c : str) {
+		switch (c) {
+			case '"': os << "\\\""; break;
+			case '\\': os << "\\\\"; break;
+			case '\n': os << "\\n"; break;
+			case '\r': os << "\\r"; break;
+			case '\t': os << "\\t"; break;
+			default:
+				if ((unsigned char)c < 0x20) {
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+					os << buf;
+				}
+				else
+					os << c;
+		}
+	}
+	os << '"';
+}
+
+inline void writeValue(std::ostream &os, std::string_view v) { writeString(os, v); }
+inline void writeValue(std::ostream &os, const char* v) { writeString(os, v); }
+inline void writeValue(std::ostream &os, const std::string &v) { writeString(os, v); }
+inline void writeValue(std::ostream &os, char v) { writeString(os, std::string_view(&v, 1)); }
+inline void writeValue(std::ostream &os, bool v) { os << (v ? "true" : "false"); }
+inline void writeValue(std::ostream &os, double v) { os << v; }
+inline void writeValue(std::ostream &os, int v) { os << v; }
+inline void writeValue(std::ostream &os, unsigned v) { os << v; }
+inline void writeValue(std::ostream &os, long v) { os << v; }
+inline void writeValue(std::ostream &os, unsigned long v) { os << v; }
+inline void writeValue(std::ostream &os, long long v) { os << v; }
+inline void writeValue(std::ostream &os, unsigned long long v) { os << v; }
+
+inline void writeFields(std::ostream &/*os*/) {}
+
+template <typename V, typename ...Rest>
+void writeFields(std::ostream &os, const char* key, const V &value, const Rest& ...rest)
+{
+	os << ',';
+	writeString(os, key);
+	os << ':';
+	writeValue(os, value);
+	writeFields(os, rest...);
+}
+
+//Formats one event; fields are alternating key, value pairs
+template <typename ...Fields>
+void emit(Category cat, Level level, std::string_view msg, const Fields& ...fields)
+{
+	State &s = state();
+	std::ostringstream os;
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s.start).count();
+	os << "{\"t\":" << us << ",\"cat\":\"" << categoryName(cat) << "\",\"level\":\"" << levelName(level) << "\",\"msg\":";
+	writeString(os, msg);
+	writeFields(os, fields...);
+	os << "}\n";
+
+	if (captureBuffer) {
+		*captureBuffer += os.str();
+		return;
+	}
+	std::lock_guard<std::mutex> guard(s.lock);
+	*s.sink << os.str();
+}
+
+//Writes events previously captured with captureBuffer
+inline void flush(const std::string &events)
+{
+	if (events.empty())
+		return;
+	State &s = state();
+	std::lock_guard<std::mutex> guard(s.lock);
+	*s.sink << events;
+}
+
+//Comma separated list of lexer, parser, codegen, pass, all; returns false on an unknown name
+inline bool setCategories(const std::string &list)
+{
+	uint32_t mask = 0;
+	std::stringstream ss(list);
+	std::string name;
+	while (std::getline(ss, name, ',')) {
+		if (name == "lexer") mask |= traceLexer;
+		else if (name == "parser") mask |= traceParser;
+		else if (name == "codegen") mask |= traceCodegen;
+		else if (name == "pass") mask |= tracePass;
+		else if (name == "all") mask |= traceAll;
+		else return false;
+	}
+	activeCategories = mask;
+	return true;
+}
+
+inline bool setLevel(const std::string &name)
+{
+	if (name == "error") activeLevel = traceError;
+	else if (name == "warn") activeLevel = traceWarn;
+	else if (name == "info") activeLevel = traceInfo;
+	else if (name == "debug") activeLevel = traceDebug;
+	else return false;
+	return true;
+}
+
+inline bool setFile(const std::string &fileName)
+{
+	state().file.reset(new std::ofstream(fileName));
+	if (!*state().file)
+		return false;
+	state().sink = state().file.get();
+	return true;
+}
+
+}
+
+#define KTRACE(cat, level, ...)                                  \
+	do {                                                         \
+		if (trace::enabled(trace::cat, trace::level))            \
+			trace::emit(trace::cat, trace::level, __VA_ARGS__);  \
+	} while (0)
+
+#endif
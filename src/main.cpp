@@ -1,27 +1,412 @@
 #include <iostream>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "llvm/Support/DynamicLibrary.h"
 
 #include "Parser.h"
+#include "Stats.h"
 
 
 namespace myCompiler {
 
+//--jobs above this is a typo rather than a machine
+static const unsigned long MaxJobs = 1024;
+
+//--bench-nesting: parse and generate IR for machine-generated functions nested 'depth' levels deep,
+//at a few sizes up to 'maxDepth', and report the time per AST node, which should stay flat
+static int benchNesting(size_t maxDepth)
+{
+	const char* benchFile = "bench_nesting.kl";
+	const char* shapes[] = {"chain", "parens", "calls", "ladder"};
+	for (const char* shape : shapes) {
+		for (size_t depth = std::max<size_t>(maxDepth / 8, 1); depth <= maxDepth; depth *= 2) {
+			{
+				std::ofstream src(benchFile);
+				std::string name(shape);
+				if (name == "chain") {
+					//x + x + ... + x, a left-deep tree
+					src << "def chain(x) x";
+					for (size_t i = 0; i < depth; i++)
+						src << " + x";
+				}
+				else if (name == "parens") {
+					//((x + 1) + 1)..., every level parenthesised
+					src << "def parens(x) " << std::string(depth, '(') << "x";
+					for (size_t i = 0; i < depth; i++)
+						src << " + 1)";
+				}
+				else if (name == "calls") {
+					//id(id(...id(x)...))
+					src << "def id(x) x;\ndef calls(x) ";
+					for (size_t i = 0; i < depth; i++)
+						src << "id(";
+					src << "x" << std::string(depth, ')');
+				}
+				else {
+					//if x < 0 then 0 else if x < 1 then 1 else ...
+					src << "def ladder(x) ";
+					for (size_t i = 0; i < depth; i++)
+						src << "if x < " << i << " then " << i << " else ";
+					src << "0";
+				}
+				src << ";\n";
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			Parser ps((char*)benchFile);
+			ps.MainLoop();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			std::cout << shape << " depth " << depth << ": " << ps.ast.size() << " nodes in " << elapsed.count() << " s ("
+					  << elapsed.count() * 1e9 / ps.ast.size() << " ns/node)" << std::endl;
+		}
+	}
+	std::remove(benchFile);
+	return 0;
+}
+
+//inputs of the --bench-select loop, read through 'extern benchdata(i)'
+static std::vector<double> benchValues;
+
+static double benchdata(double i)
+{
+	return benchValues[(size_t)i];
+}
+
+//--bench-select: time the 'if' of examples/kaleidoscope_if.kl in a loop over 'count' inputs, emitted
+//with branches and as a select, on random inputs (the branch goes either way at random) and on the
+//same inputs sorted (the branch is predictable)
+static int benchSelect(size_t count, CompileOptions options)
+{
+	const char* benchFile = "bench_select.kl";
+	{
+		std::ofstream src(benchFile);
+		src << "extern benchdata(i);\n"
+			<< "def bench(n) var s = 0 in\n"
+			<< "  (for i = 0, i < n, 1 in var a = benchdata(i) in s = s + (if a > 1 then i else a + i + 2)) : s;\n";
+	}
+
+	std::mt19937_64 random(42);
+	std::uniform_real_distribution<double> uniform(0.0, 2.0);
+	std::vector<double> randomValues(count);
+	for (double &value : randomValues)
+		value = uniform(random);
+	std::vector<double> sortedValues(randomValues);
+	std::sort(sortedValues.begin(), sortedValues.end());
+	llvm::sys::DynamicLibrary::AddSymbol("benchdata", (void*)&benchdata);
+
+	int status = 0;
+	const SelectIfMode modes[] = {selectIfNever, selectIfAlways};
+	for (SelectIfMode mode : modes) {
+		options.selectIf = mode;
+		Parser ps((char*)benchFile, options);
+		ps.MainLoop();
+		ps.code_Gen.optimize();
+		double (*bench)(double) = (double (*)(double))ps.code_Gen.jitFunction("bench");
+		if (!bench) {
+			status = 1;
+			break;
+		}
+		for (int sorted = 0; sorted < 2; sorted++) {
+			benchValues = sorted ? sortedValues : randomValues;
+			auto start = std::chrono::steady_clock::now();
+			double sum = bench((double)count);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			std::cout << (mode == selectIfNever ? "branch" : "select") << (sorted ? " sorted: " : " random: ") << count
+					  << " inputs in " << elapsed.count() << " s (" << elapsed.count() * 1e9 / count << " ns/input), sum "
+					  << sum << std::endl;
+		}
+	}
+	std::remove(benchFile);
+	return status;
+}
+
 int main(int argc, char* argv[])
 {
-	bool printLog = false;
+	CompileOptions options;
     
 	std::string irFile = "ex.ll";
-	char *fileName;
+	char *fileName = nullptr;
 	bool srcProvided = false;
+	bool benchLexer = false;
+	size_t benchDepth = 0;
+	size_t benchInputs = 0;
     for (int i = 1; i < argc; ++i) {
 		if (std::string(argv[i]) == "--help") {
-            std::cout << "Usage: ./a.exe --log<optional>:turn on logging\n"
+            std::cout << "Usage: ./a.exe --log<optional>:turn on all tracing, same as --trace all --trace-level debug\n"
+						<< "               --trace<optional> comma separated categories to trace: lexer,parser,codegen,pass,all\n"
+						<< "               --trace-level<optional> error (default), warn, info or debug\n"
+						<< "               --trace-file<optional> write trace events (JSON lines) here instead of stderr\n"
+						<< "               --echo-ir<optional> print the IR of each function to stderr as it is generated\n"
 			            << "               --ir-dump<optional> file for ir dump; ex.ll by default\n"
-						<< "               --src<compulsory> source file\n";
+						<< "               --src<compulsory> source file, \"-\" reads stdin\n"
+						<< "               --prelex<optional> lex the whole source before parsing\n"
+						<< "               --jobs<optional> threads parsing top-level definitions, 0 uses every core; implies --prelex\n"
+						<< "               --hash-cons<optional> share identical side-effect-free subexpressions and reuse their values\n"
+						<< "               --no-simplify<optional> generate code for the AST as parsed, without constant folding\n"
+						<< "               --eval-steps<optional> budget for evaluating a pure call with literal arguments at compile time, 1000000 by default; 0 disables\n"
+						<< "               --specialize-budget<optional> AST nodes the simplifier may clone into copies of functions specialized for literal arguments, 2000 by default; 0 disables\n"
+						<< "               --auto-memoize<optional> cache results of pure self-recursive functions at run time; needs the simplifier\n"
+						<< "               --memo-entries<optional> results cached per memoized function, 4096 by default\n"
+						<< "               --tail-accumulate<optional> loop 'x * f(...)' and 'f(...) + x' in tail position through an accumulator; reassociates floating point math\n"
+						<< "               --no-int-inference<optional> keep loop counters proven integral as doubles instead of i64\n"
+						<< "               --no-direct-ssa<optional> keep every argument and variable in a stack slot, not only those assigned with '='\n"
+						<< "               --select-if<optional> never, auto (default) or always: emit an 'if' with side-effect-free arms as a select instead of branches\n"
+						<< "               -O0 (default), -O1, -O2, -O3, -Os<optional> optimize the module with the pipeline of that level before writing IR and object code\n"
+						<< "               --mcpu<optional> CPU to generate code for, \"native\" for the host's CPU and features; generic by default\n"
+						<< "               --mattr<optional> comma separated target features to add or remove, e.g. +avx2,-fma\n"
+						<< "               --ffast-math<optional> every fast-math flag and --fp-contract=fast; 'def strict f(x)' opts a function out\n"
+						<< "               --fp-flags<optional> comma separated fast-math flags for floating point operations: nnan, ninf, nsz, reassoc, arcp, afn\n"
+						<< "               --fp-contract<optional> off (default), on (fuse a*b+c within an expression) or fast (fuse anywhere)\n"
+						<< "               --multiversion<optional> clone every function for x86-64, -v2, -v3 and -v4, and pick the clones for the CPU at load time\n"
+						<< "               --multiversion-force<optional> x86-64, x86-64-v2, x86-64-v3 or x86-64-v4: always pick the clones of that level, for testing\n"
+						<< "               --stats<optional> print compile statistics to stderr when done\n"
+						<< "               --bench-lexer<optional> only lex the source and report throughput\n"
+						<< "               --bench-nesting<optional> max depth: time parsing and IR generation of deeply nested generated code\n"
+						<< "               --bench-select<optional> input count: time an 'if' emitted with branches and as a select, on random and sorted inputs\n";
 			return 0;
         }
         else if (std::string(argv[i]) == "--log") {
-            printLog = true;
+            trace::setCategories("all");
+            trace::setLevel("debug");
         }
+		else if (std::string(argv[i]) == "--trace") {
+			if (i + 1 < argc && trace::setCategories(argv[i + 1])) {
+				i++;
+			}
+			else {
+				std::cerr << "--trace requires a list of lexer,parser,codegen,pass,all" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--trace-level") {
+			if (i + 1 < argc && trace::setLevel(argv[i + 1])) {
+				i++;
+			}
+			else {
+				std::cerr << "--trace-level requires one of error,warn,info,debug" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--trace-file") {
+			if (i + 1 < argc && trace::setFile(argv[i + 1])) {
+				i++;
+			}
+			else {
+				std::cerr << "--trace-file requires a writable file" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--echo-ir") {
+			options.echoIR = true;
+		}
+		else if (std::string(argv[i]) == "--prelex") {
+			options.prelex = true;
+		}
+		else if (std::string(argv[i]) == "--hash-cons") {
+			options.hashCons = true;
+		}
+		else if (std::string(argv[i]) == "--no-simplify") {
+			options.simplify = false;
+		}
+		else if (std::string(argv[i]) == "--eval-steps") {
+			if (i + 1 < argc) {
+				i++;
+				options.evalSteps = std::strtoull(argv[i], nullptr, 10);
+			}
+			else {
+				std::cerr << "--eval-steps requires a step count" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--specialize-budget") {
+			if (i + 1 < argc) {
+				i++;
+				options.specializeBudget = std::strtoull(argv[i], nullptr, 10);
+			}
+			else {
+				std::cerr << "--specialize-budget requires a node count" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--auto-memoize") {
+			options.autoMemoize = true;
+		}
+		else if (std::string(argv[i]) == "--memo-entries") {
+			if (i + 1 < argc && std::strtoul(argv[i + 1], nullptr, 10) > 0) {
+				i++;
+				options.memoEntries = std::strtoul(argv[i], nullptr, 10);
+			}
+			else {
+				std::cerr << "--memo-entries requires a positive table size" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--tail-accumulate") {
+			options.tailAccumulate = true;
+		}
+		else if (std::string(argv[i]) == "--no-int-inference") {
+			options.inferIntegers = false;
+		}
+		else if (std::string(argv[i]) == "--no-direct-ssa") {
+			options.directSSA = false;
+		}
+		else if (std::string(argv[i]) == "--select-if") {
+			std::string mode = i + 1 < argc ? argv[i + 1] : "";
+			if (mode == "never" || mode == "auto" || mode == "always") {
+				i++;
+				options.selectIf = mode == "never" ? selectIfNever : mode == "auto" ? selectIfAuto : selectIfAlways;
+			}
+			else {
+				std::cerr << "--select-if requires one of never,auto,always" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]).size() == 3 && std::string(argv[i]).compare(0, 2, "-O") == 0) {
+			char level = argv[i][2];
+			if (level >= '0' && level <= '3') {
+				options.optLevel = level - '0';
+				options.optSize = false;
+			}
+			else if (level == 's') {
+				options.optLevel = 2;
+				options.optSize = true;
+			}
+			else {
+				std::cerr << "unknown optimization level " << argv[i] << ", use -O0, -O1, -O2, -O3 or -Os" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]).substr(0, std::string(argv[i]).find('=')) == "--mcpu" ||
+				 std::string(argv[i]).substr(0, std::string(argv[i]).find('=')) == "--mattr") {
+			//--mcpu <name> or --mcpu=<name>, the same for --mattr
+			std::string flag = argv[i];
+			std::string value;
+			size_t equals = flag.find('=');
+			if (equals != std::string::npos) {
+				value = flag.substr(equals + 1);
+				flag = flag.substr(0, equals);
+			}
+			else if (i + 1 < argc)
+				value = argv[++i];
+			if (value.empty()) {
+				std::cerr << flag << (flag == "--mcpu" ? " requires a CPU name or native" : " requires a feature list") << std::endl;
+				return 1;
+			}
+			(flag == "--mcpu" ? options.cpu : options.features) = value;
+		}
+		else if (std::string(argv[i]) == "--ffast-math") {
+			options.fpFlags = fpAllFlags;
+			options.fpContract = fpContractFast;
+		}
+		else if (std::string(argv[i]).substr(0, std::string(argv[i]).find('=')) == "--fp-contract" ||
+				 std::string(argv[i]).substr(0, std::string(argv[i]).find('=')) == "--fp-flags") {
+			//--fp-contract <mode> or --fp-contract=<mode>, the same for --fp-flags
+			std::string flag = argv[i];
+			std::string value;
+			size_t equals = flag.find('=');
+			if (equals != std::string::npos) {
+				value = flag.substr(equals + 1);
+				flag = flag.substr(0, equals);
+			}
+			else if (i + 1 < argc)
+				value = argv[++i];
+			if (flag == "--fp-contract") {
+				if (value == "off")
+					options.fpContract = fpContractOff;
+				else if (value == "on")
+					options.fpContract = fpContractOn;
+				else if (value == "fast")
+					options.fpContract = fpContractFast;
+				else {
+					std::cerr << "--fp-contract requires one of off,on,fast" << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::stringstream list(value);
+				std::string name;
+				while (std::getline(list, name, ',')) {
+					if (name == "nnan")
+						options.fpFlags |= fpNoNaNs;
+					else if (name == "ninf")
+						options.fpFlags |= fpNoInfs;
+					else if (name == "nsz")
+						options.fpFlags |= fpNoSignedZeros;
+					else if (name == "reassoc")
+						options.fpFlags |= fpReassoc;
+					else if (name == "arcp")
+						options.fpFlags |= fpReciprocal;
+					else if (name == "afn")
+						options.fpFlags |= fpApproxFunc;
+					else {
+						std::cerr << "unknown floating point flag '" << name << "', use nnan, ninf, nsz, reassoc, arcp or afn" << std::endl;
+						return 1;
+					}
+				}
+			}
+		}
+		else if (std::string(argv[i]) == "--multiversion") {
+			options.multiversion = true;
+		}
+		else if (std::string(argv[i]) == "--multiversion-force") {
+			std::string level = i + 1 < argc ? argv[i + 1] : "";
+			options.forceIsaLevel = -1;
+			for (int l = 0; l < (int)Code_Gen::IsaLevels; l++)
+				if (level == Code_Gen::IsaLevelNames[l])
+					options.forceIsaLevel = l;
+			if (options.forceIsaLevel < 0) {
+				std::cerr << "--multiversion-force requires one of x86-64,x86-64-v2,x86-64-v3,x86-64-v4" << std::endl;
+				return 1;
+			}
+			i++;
+			options.multiversion = true;
+		}
+		else if (std::string(argv[i]) == "--stats") {
+			stats::state().enabled = true;
+		}
+		else if (std::string(argv[i]) == "--jobs") {
+			//digits only, so "-1" is not wrapped around by strtoul
+			char* last = nullptr;
+			unsigned long jobs = 0;
+			if (i + 1 < argc && std::isdigit((unsigned char)argv[i + 1][0]))
+				jobs = std::strtoul(argv[i + 1], &last, 10);
+			if (!last || *last || jobs > MaxJobs) {
+				std::cerr << "--jobs requires a thread count from 0 to " << MaxJobs << std::endl;
+				return 1;
+			}
+			i++;
+			options.jobs = jobs ? (unsigned)jobs : std::max(1u, std::thread::hardware_concurrency());
+			options.prelex = true;
+		}
+		else if (std::string(argv[i]) == "--bench-lexer") {
+			benchLexer = true;
+		}
+		else if (std::string(argv[i]) == "--bench-nesting") {
+			if (i + 1 < argc) {
+				i++;
+				benchDepth = std::strtoul(argv[i], nullptr, 10);
+			}
+			else {
+				std::cerr << "--bench-nesting requires a depth" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--bench-select") {
+			if (i + 1 < argc && std::strtoul(argv[i + 1], nullptr, 10) > 0) {
+				i++;
+				benchInputs = std::strtoul(argv[i], nullptr, 10);
+			}
+			else {
+				std::cerr << "--bench-select requires an input count" << std::endl;
+				return 1;
+			}
+		}
 		else if (std::string(argv[i]) == "--ir-dump") {
 			if (i + 1 < argc) {
 				i++;
@@ -45,16 +430,41 @@ int main(int argc, char* argv[])
 		}
     }
 	
+	if (benchDepth)
+		return benchNesting(benchDepth);
+	if (benchInputs)
+		return benchSelect(benchInputs, options);
+	
 	if (!srcProvided)
 	{
 		std::cerr << "No source file provided" << std::endl;
 		return 1;
 	}
     
-    Parser ps(fileName, printLog);
+	if (benchLexer)
+	{
+		StringInterner identifiers;
+		lexer lex(fileName, identifiers);
+		size_t tokens = 0;
+		auto start = std::chrono::steady_clock::now();
+		while (lex.getTok().tok != lexer::tok_eof)
+			tokens++;
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		double mb = lex.bytesRead() / (1024.0 * 1024.0);
+		std::cout << "lexed " << tokens << " tokens, " << mb << " MB in " << elapsed.count() << " s ("
+				  << mb / elapsed.count() << " MB/s)" << std::endl;
+		return 0;
+	}
+    
+    Parser ps(fileName, options);
 	//TheModule = make_unique<Module>("my cool jit", TheContext);
     ps.MainLoop();
 	
+	if (options.multiversion && !ps.code_Gen.multiversion()) {
+		std::cerr << "--multiversion needs an x86-64 target" << std::endl;
+		return 1;
+	}
+	ps.code_Gen.optimize();
 	ps.code_Gen.WriteIRFile(irFile);
 	
 	if (!(ps.code_Gen).WriteObjectFile()) {
@@ -63,6 +473,10 @@ int main(int argc, char* argv[])
 	else {
 		std::cout << "Error writing object file" << std::endl;
 	}
+
+	if (stats::enabled())
+		stats::print(std::cerr);
+	return 0;
 }
 
 }
\ No newline at end of file